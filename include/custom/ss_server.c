@@ -1,78 +1,139 @@
 #include "ss_server.h"
 
+static void server_srv_wake(struct syko_session *session)
+{
+	server_srv_t *g = lws_container_of(session, server_srv_t, session);
+
+	if (lws_ss_request_tx(lws_ss_from_user(g)))
+		lwsl_warn("%s: request tx failed\n", __func__);
+}
+
+static void server_srv_can_wake(struct syko_can_sub *sub)
+{
+	server_srv_wake(lws_container_of(sub, struct syko_session, can_sub));
+}
+
+/* A CAN transfer finished, its reply can go out now */
+static void server_srv_complete(struct syko_session *session, int sequence, const char *status,
+								const char *payload, size_t payload_len)
+{
+	server_srv_t *g = lws_container_of(session, server_srv_t, session);
+	struct syko_response *rsp = sykoTxFind(&g->tx_queue, sequence);
+	char *p;
+
+	if (!rsp)
+		return;
+
+	rsp->reply.status = status;
+	if (payload) {
+		p = sykoArenaAlloc(&rsp->arena, payload_len);
+		if (p) {
+			memcpy(p, payload, payload_len);
+			rsp->reply.payload = p;
+			rsp->reply.payload_len = payload_len;
+		} else
+			rsp->reply.status = "error";
+	}
+	sykoResponseReady(rsp);
+
+	if (lws_ss_request_tx(lws_ss_from_user(g)))
+		lwsl_warn("%s: request tx failed\n", __func__);
+}
+
 static lws_ss_state_return_t server_srv_rx(void *userobj, const uint8_t *buf, size_t len, int flags)
 {
 	server_srv_t *g = (server_srv_t *)userobj;  	
-	char * json_res_str = NULL;
-	cJSON * json_response;
-	size_t len_to_send;
+	const struct syko_template *tmpl;
+	struct syko_response *rsp;
+	struct syko_request *req;
+	const char *status = NULL;
+	int n;
 
-	char *json_request = (char *)malloc(len + 1);
-    if (!json_request) return LWSSSSRET_DISCONNECT_ME;
+	n = sykoSessionRx(&g->session, buf, len, flags);
+	if (n <= 0)
+		return n < 0 ? LWSSSSRET_DISCONNECT_ME : LWSSSSRET_OK;
 
-    memcpy(json_request, buf, len);
-    json_request[len] = '\0';
+	req = g->session.req;
+	n = 0;
 
-	enum commands received_command = sykoCommandsHandler(cJSON_Parse(json_request));
+	const struct syko_command *cmd = sykoCommandsHandler(req);
 
-	free(json_request); 
+	// A client whose refusals pile up unread as well isn't reading at all
+	if (g->tx_queue.count >= SYKO_TX_INFLIGHT_MAX + SYKO_TX_BUSY_MAX) {
+		lwsl_warn("%s: tx queue full, dropping the client\n", __func__);
+		return LWSSSSRET_DISCONNECT_ME;
+	}
 
-	switch (received_command){
-		case remotegui_device_info: 
-			json_response = remotegui_device_info_fnc();			
-			break;
-		case remotegui_program_vehicle: 
-			json_response = remotegui_program_vehicle_fnc();
-			break;			
-		case get_basic_config: 			
-		case get_full_config:			
-		case get_available_features: 		
-		case remotegui_vehicle_info: 			
-		case remotegui_read_dtc: 			
-		case remotegui_clear_dtc: 			
-		case remotegui_datalog: 			
-		case remotegui_user_input:				
-		default:
-			json_response = unknown_command_fnc();			
-			break;
-	}	   
+	// Refuse rather than queue without bound, and keep sequences unambiguous
+	if (g->tx_queue.count >= SYKO_TX_INFLIGHT_MAX)
+		status = "busy";
+	else if (sykoTxFind(&g->tx_queue, req->sequence))
+		status = "duplicate-sequence";
+
+	rsp = sykoResponseCreate(&g->tx_queue);
+	if (!rsp)
+		return LWSSSSRET_DISCONNECT_ME;
+
+	rsp->reply.sequence = req->sequence;
+	rsp->reply.response = cmd->name;
+	rsp->reply.status = status ? status : "ok";
+
+	// Constant replies were rendered at startup, only the sequence goes in
+	tmpl = status ? sykoTemplateGet(unknown_command) : sykoTemplateConst(cmd->id);
+	if (!tmpl) {
+		// Whatever the handler allocates for its reply lives in the response arena
+		sykoArenaBegin(&rsp->arena);
+		n = cmd->fnc(req, &rsp->reply);
+		sykoArenaDetach();
+		tmpl = sykoTemplateGet(cmd->id);
+	}
+
+	sykoSessionRxDone(&g->session);
+
+	if (n < 0) {
+		sykoResponseDestroy(rsp);
+		return LWSSSSRET_DISCONNECT_ME;
+	}
 
-	json_res_str = cJSON_PrintUnformatted(json_response);
-	len_to_send = strlen(json_res_str);
+	sykoResponseTemplate(rsp, tmpl);
 
-    memcpy(g->payload, json_res_str, len_to_send);
-    g->size = len_to_send;
-    g->pos = 0;
+	// Pending replies are marked ready by whoever completes them
+	if (n == SYKO_REPLY_PENDING)
+		return LWSSSSRET_OK;
 
-	lwsl_user("%d\n", len_to_send);
+	sykoResponseReady(rsp);
 
-	free(json_res_str);
-    cJSON_Delete(json_response);
-   
-    return lws_ss_request_tx_len(lws_ss_from_user(g), g->size);
+    return lws_ss_request_tx(lws_ss_from_user(g));
 }
 
 static lws_ss_state_return_t server_srv_tx(void *userobj, lws_ss_tx_ordinal_t ord, uint8_t *buf, size_t *len, int *flags)
 {
 	server_srv_t *g = (server_srv_t *)userobj;
 	lws_ss_state_return_t r = LWSSSSRET_OK;
+	size_t n;
+
+	// Upload and flash news and monitored CAN frames go out between responses, never inside one
+	if (!sykoTxReady(&g->tx_queue)) {
+		n = sykoUploadWrite(&g->session, buf, *len);
+		if (!n)
+			n = sykoFlashWrite(&g->session, buf, *len);
+		if (!n)
+			n = sykoCanMonWrite(&g->session.can_sub, buf, *len);
+		if (!n)
+			return LWSSSSRET_TX_DONT_SEND;
+
+		*len = n;
+		*flags = LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
+		if (sykoUploadPending(&g->session) || sykoFlashPending(&g->session) ||
+		    sykoCanMonPending(&g->session.can_sub))
+			r = lws_ss_request_tx(lws_ss_from_user(g));
+
+		return r;
+	}
 
-	if (g->size == g->pos)
-		return LWSSSSRET_TX_DONT_SEND;
-
-	if (*len > g->size - g->pos)
-		*len = g->size - g->pos;
-
-	if (!g->pos)
-		*flags |= LWSSS_FLAG_SOM;
-
-	memcpy(buf, g->payload + g->pos, *len);
-	g->pos += *len;
-
-	if (g->pos != g->size) /* more to do */
+	// Fills the window from the head response, resuming on the next call
+	if (sykoTxWrite(&g->tx_queue, buf, len, flags)) /* more to do */
 		r = lws_ss_request_tx(lws_ss_from_user(g));
-	else
-		*flags |= LWSSS_FLAG_EOM;
 
 	lwsl_ss_user(lws_ss_from_user(g), "TX %zu, flags 0x%x, r %d", *len, (unsigned int)*flags, (int)r);
 
@@ -82,13 +143,26 @@ static lws_ss_state_return_t server_srv_tx(void *userobj, lws_ss_tx_ordinal_t or
 static lws_ss_state_return_t server_srv_state(void *userobj, void *sh, lws_ss_constate_t state, lws_ss_tx_ordinal_t ack)
 {
 	server_srv_t *g = (server_srv_t *)userobj;
+	struct syko_response *rsp;
+	char hello[64];
+	size_t n;
 
 	lwsl_user("%s: %p %s, ord 0x%x\n", __func__, g->ss, lws_ss_state_name(state), (unsigned int)ack);
 
 	switch ((int)state) {
 		case LWSSSCS_CREATING:
+			g->session.can_sub.wake = server_srv_can_wake;
+			g->session.complete = server_srv_complete;
+			g->session.wake = server_srv_wake;
 			return lws_ss_request_tx(lws_ss_from_user(g));
 
+		case LWSSSCS_DESTROYING:
+			sykoCanMonUnsubscribe(&g->session.can_sub);
+			sykoCommandsClose(&g->session);
+			sykoSessionRxDone(&g->session);
+			sykoTxFlush(&g->tx_queue);
+			break;
+
 		case LWSSSCS_SERVER_TXN:
 			/*
 			* A transaction is starting on an accepted connection.  Say
@@ -100,10 +174,16 @@ static lws_ss_state_return_t server_srv_state(void *userobj, void *sh, lws_ss_co
 			if (lws_ss_set_metadata(lws_ss_from_user(g), "mime", "text/html", 9))
 				return LWSSSSRET_DISCONNECT_ME;
 
-			g->size	= (size_t)lws_snprintf(g->payload, sizeof(g->payload), "Hello World: %lu", (unsigned long)lws_now_usecs());
-			g->pos = 0;
+			rsp = sykoResponseCreate(&g->tx_queue);
+			if (!rsp)
+				return LWSSSSRET_DISCONNECT_ME;
+
+			n = (size_t)lws_snprintf(hello, sizeof(hello), "Hello World: %lu", (unsigned long)lws_now_usecs());
+			if (sykoResponseAppend(rsp, hello, n))
+				return LWSSSSRET_DISCONNECT_ME;
+			sykoResponseReady(rsp);
 
-			return lws_ss_request_tx_len(lws_ss_from_user(g), (unsigned long)g->size);
+			return lws_ss_request_tx_len(lws_ss_from_user(g), (unsigned long)n);
 	}
 
 	return LWSSSSRET_OK;
@@ -1,6 +1,7 @@
 #include <libwebsockets.h>
 #include <cjson.h>
 #include "syko_handler.h"
+#include "syko_tx.h"
 
 typedef enum {
     CHANNEL_UNKNOWN = 0,
@@ -9,9 +10,8 @@ typedef enum {
 } channel_type_t;
 
 LWS_SS_USER_TYPEDEF
-	char						payload[1024];
-	size_t						size;
-	size_t						pos;
+	lws_dll2_owner_t			tx_queue;	// struct syko_response
+	struct syko_session			session;
 	// channel_type_t 				type;
 } server_srv_t;
 
@@ -0,0 +1,50 @@
+#include "syko_arena.h"
+
+#define SYKO_ARENA_CHUNK    2048
+
+static struct syko_arena *current_arena;
+
+void * sykoArenaAlloc(struct syko_arena *arena, size_t size){
+    arena->allocs++;
+    arena->bytes += size;
+
+    return lwsac_use(&arena->ac, size, SYKO_ARENA_CHUNK);
+}
+
+static void * sykoArenaMalloc(size_t size){
+    if (!current_arena)
+        return malloc(size);
+
+    return sykoArenaAlloc(current_arena, size);
+}
+
+static void sykoArenaFree(void *ptr){
+    // Arena memory is released all at once by sykoArenaEnd()
+    if (!current_arena)
+        free(ptr);
+}
+
+void sykoArenaInit(){
+    cJSON_Hooks hooks = { sykoArenaMalloc, sykoArenaFree };
+
+    cJSON_InitHooks(&hooks);
+}
+
+void sykoArenaBegin(struct syko_arena *arena){
+    memset(arena, 0, sizeof(*arena));
+    current_arena = arena;
+}
+
+void sykoArenaDetach(){
+    current_arena = NULL;
+}
+
+void sykoArenaEnd(struct syko_arena *arena){
+    lwsl_debug("%s: %u allocs, %zu bytes, %llu heap\n", __func__, arena->allocs,
+               arena->bytes, (unsigned long long)lwsac_total_alloc(arena->ac));
+
+    if (current_arena == arena)
+        current_arena = NULL;
+
+    lwsac_free(&arena->ac);
+}
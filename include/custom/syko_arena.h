@@ -0,0 +1,26 @@
+#ifndef SYKO_ARENA_H
+#define SYKO_ARENA_H
+
+#include <libwebsockets.h>
+#include <cjson.h>
+
+/*
+ * Request-scoped arena for cJSON. While an arena is active every cJSON
+ * allocation is carved out of an lwsac and frees are ignored; ending the
+ * arena releases the whole request in one step. Outside an arena cJSON
+ * falls back to plain malloc/free. An arena can be detached once the
+ * tree is built and kept alive until its last consumer ends it.
+ */
+struct syko_arena {
+    struct lwsac *ac;
+    unsigned int allocs;
+    size_t bytes;
+};
+
+void sykoArenaInit();
+void sykoArenaBegin(struct syko_arena *arena);
+void sykoArenaDetach();
+void sykoArenaEnd(struct syko_arena *arena);
+void * sykoArenaAlloc(struct syko_arena *arena, size_t size);
+
+#endif
@@ -0,0 +1,690 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // sendmmsg, recvmmsg
+#endif
+#include "syko_bench.h"
+#include "syko_arena.h"
+#include "syko_can.h"
+#include "syko_handler.h"
+#include "syko_isotp.h"
+#include "syko_request.h"
+#include "syko_vecu.h"
+
+#include <cjson.h>
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_JSON      (1u << 0)
+#define BENCH_CAN       (1u << 1)
+#define BENCH_ISOTP     (1u << 2)
+#define BENCH_CMD       (1u << 3)
+#define BENCH_RSP       (1u << 4)
+
+#define BENCH_CAN_ROUND     (SYKO_CAN_BATCH * 2)        // Frames queued per rx drain
+#define BENCH_STALL_US      (5000 * LWS_US_PER_MS)      // No ISO-TP progress in this long
+
+enum syko_bench_rx {
+    BENCH_RX_READ,
+    BENCH_RX_MMSG,
+    BENCH_RX_MMSG_TS,
+};
+
+struct syko_bench_clock {
+    struct timespec wall0, cpu0;
+    double wall, cpu;               // Seconds measured so far
+};
+
+// What we advertise in our flow control for each receive run
+static const struct {
+    uint8_t bs, stmin;
+} bench_fc[] = {
+    { 0, 0 }, { 2, 0 }, { 8, 0 }, { 8, 0xF5 }, { 0, 1 },
+};
+
+struct syko_bench {
+    lws_sorted_usec_list_t sul;
+    struct lws_context *cx;
+    const char *ifname;
+    unsigned int what;
+    struct syko_bench_clock clk;
+    unsigned int step;              // bench_fc index, past its end is the transmit run
+    unsigned int msgs;
+    size_t bytes;
+    uint8_t buf[SYKO_ISOTP_MAX];    // What the transmit run sends
+};
+
+static struct syko_bench bench;
+
+// Same layout as syko_can's batches, one set to send from and one to receive into
+static struct can_frame bench_tx_frames[SYKO_CAN_BATCH], bench_rx_frames[SYKO_CAN_BATCH];
+static struct iovec bench_tx_iov[SYKO_CAN_BATCH], bench_rx_iov[SYKO_CAN_BATCH];
+static struct mmsghdr bench_tx_msgs[SYKO_CAN_BATCH], bench_rx_msgs[SYKO_CAN_BATCH];
+static uint8_t bench_rx_cmsg[SYKO_CAN_BATCH][CMSG_SPACE(sizeof(struct scm_timestamping))];
+static uint8_t bench_rsp[1024];            // One rendered response
+
+static double sykoBenchSecs(const struct timespec *a, const struct timespec *b){
+    return (double)(b->tv_sec - a->tv_sec) + (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static void sykoBenchGo(struct syko_bench_clock *c){
+    clock_gettime(CLOCK_MONOTONIC, &c->wall0);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c->cpu0);
+}
+
+static void sykoBenchHalt(struct syko_bench_clock *c){
+    struct timespec wall, cpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    c->wall += sykoBenchSecs(&c->wall0, &wall);
+    c->cpu += sykoBenchSecs(&c->cpu0, &cpu);
+}
+
+/* One result line, then the clock starts over */
+static void sykoBenchReport(const char *name, struct syko_bench_clock *c, unsigned long n,
+                            const char *unit, size_t bytes){
+    if (!n || c->wall <= 0)
+        lwsl_user("bench %-36s no result\n", name);
+    else if (bytes)
+        lwsl_user("bench %-36s %10.0f %s/s %9.3f us cpu/%s %10.1f KiB/s\n", name,
+                  (double)n / c->wall, unit, c->cpu * 1e6 / (double)n, unit,
+                  (double)bytes / c->wall / 1024);
+    else
+        lwsl_user("bench %-36s %10.0f %s/s %9.3f us cpu/%s\n", name,
+                  (double)n / c->wall, unit, c->cpu * 1e6 / (double)n, unit);
+
+    memset(c, 0, sizeof(*c));
+}
+
+static void sykoBenchDone(struct syko_bench *b){
+    lws_sul_cancel(&b->sul);
+    sykoIsotpOnRx(ecu_main, NULL, NULL);
+    sykoIsotpConfig(ecu_main, 0, 0);
+    lws_default_loop_exit(b->cx);
+}
+
+/* The old path: a whole tree, of which only the routing fields are read */
+static int sykoBenchJsonTree(const char *msg){
+    cJSON *root = cJSON_Parse(msg);
+    int ok;
+
+    if (!root)
+        return 0;
+
+    ok = cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(root, "sequence")) &&
+         cJSON_IsString(cJSON_GetObjectItemCaseSensitive(root, "request"));
+    cJSON_Delete(root);
+
+    return ok;
+}
+
+/* The streaming decoder, fed seg bytes per rx callback as ss_server does */
+static int sykoBenchJsonStream(struct syko_request *req, const char *msg, size_t len, size_t seg){
+    size_t off, n;
+    int flags;
+
+    sykoRequestBegin(req);
+    for (off = 0; off < len; off += n) {
+        n = len - off < seg ? len - off : seg;
+        flags = (off ? 0 : LWSSS_FLAG_SOM) | (off + n == len ? LWSSS_FLAG_EOM : 0);
+        if (sykoRequestParse(req, (const uint8_t *)msg + off, n, flags))
+            break;
+    }
+
+    return req->state == SYKO_REQ_DONE && (req->seen & SYKO_REQ_SEEN_REQUEST);
+}
+
+/* seg 0 decodes through cJSON */
+static void sykoBenchJsonRun(const char *name, struct syko_request *req, const char *msg,
+                             size_t len, size_t seg, unsigned long runs){
+    struct syko_bench_clock c;
+    unsigned long ok = 0;
+
+    memset(&c, 0, sizeof(c));
+    sykoBenchGo(&c);
+    for (unsigned long i = 0; i < runs; i++)
+        ok += (unsigned long)(seg ? sykoBenchJsonStream(req, msg, len, seg) : sykoBenchJsonTree(msg));
+    sykoBenchHalt(&c);
+
+    if (ok != runs)
+        lwsl_warn("bench %s: %lu of %lu requests decoded\n", name, ok, runs);
+    sykoBenchReport(name, &c, runs, "req", len * runs);
+}
+
+static void sykoBenchJson(){
+    static const char small[] =
+        "{\"sequence\":1,\"request\":\"remotegui/read-dtc\",\"params\":{\"ecu\":\"main\"}}";
+    static const char head[] =
+        "{\"sequence\":2,\"request\":\"remotegui/program-vehicle\",\"params\":{\"ecu\":\"main\",\"pad\":\"";
+    const size_t big_len = 64 * 1024;
+    struct syko_request *req = sykoRequestCreate();
+    char *big = malloc(big_len + 1);
+
+    if (!req || !big) {
+        lwsl_err("%s: OOM\n", __func__);
+        goto bail;
+    }
+
+    // 64 KiB, nearly all of it one string the handler never looks at
+    memcpy(big, head, sizeof(head) - 1);
+    memset(big + sizeof(head) - 1, 'A', big_len - (sizeof(head) - 1) - 3);
+    memcpy(big + big_len - 3, "\"}}", 4);
+
+    sykoBenchJsonRun("json small cjson", req, small, sizeof(small) - 1, 0, SYKO_BENCH_JSON_RUNS);
+    sykoBenchJsonRun("json small stream", req, small, sizeof(small) - 1, sizeof(small),
+                     SYKO_BENCH_JSON_RUNS);
+    sykoBenchJsonRun("json 64k cjson", req, big, big_len, 0, SYKO_BENCH_JSON_RUNS / 100);
+    sykoBenchJsonRun("json 64k stream", req, big, big_len, big_len, SYKO_BENCH_JSON_RUNS / 100);
+    sykoBenchJsonRun("json 64k stream split", req, big, big_len, SYKO_BENCH_JSON_SEGMENT,
+                     SYKO_BENCH_JSON_RUNS / 100);
+
+bail:
+    free(big);
+    sykoRequestDestroy(req);
+}
+
+/* What user-001 replaced: the same strcmp() per command, in table order, until one matches */
+static const struct syko_command * sykoBenchCmdChain(const char *name){
+    for (unsigned int id = 1; id < commands_count; id++)
+        if (!strcmp(sykoCommandsGet(id)->name, name))
+            return sykoCommandsGet(id);
+
+    return sykoCommandsGet(unknown_command);
+}
+
+/* Every command in the table, then the misses; chain 0 is the perfect hash */
+static void sykoBenchCmdRun(const char *name, const char * const *names, const size_t *lens,
+                            unsigned int count, int chain){
+    struct syko_bench_clock c;
+    unsigned long sum = 0;
+
+    memset(&c, 0, sizeof(c));
+    sykoBenchGo(&c);
+    for (unsigned long i = 0; i < SYKO_BENCH_CMD_RUNS; i++)
+        for (unsigned int n = 0; n < count; n++)
+            sum += (chain ? sykoBenchCmdChain(names[n]) : sykoCommandsLookup(names[n], lens[n]))->id;
+    sykoBenchHalt(&c);
+
+    // Both resolve every name the same way, or one of them is broken
+    if (sum != SYKO_BENCH_CMD_RUNS * (unsigned long)(commands_count - 1) * commands_count / 2)
+        lwsl_warn("bench %s: lookups disagree with the table\n", name);
+    sykoBenchReport(name, &c, SYKO_BENCH_CMD_RUNS * count, "lookup", 0);
+}
+
+static void sykoBenchCmd(){
+    static const char * const misses[] = {
+        "",
+        "get/basic-confih",                 // Same length as a command, last byte off
+        "remotegui/device-info-x",
+        "remotegui/unknown",
+        "get/basic-config/",
+    };
+    const char *names[commands_count - 1 + LWS_ARRAY_SIZE(misses)];
+    size_t lens[LWS_ARRAY_SIZE(names)];
+    unsigned int n = 0;
+
+    for (unsigned int id = 1; id < commands_count; id++)
+        names[n++] = sykoCommandsGet(id)->name;
+    for (unsigned int i = 0; i < LWS_ARRAY_SIZE(misses); i++)
+        names[n++] = misses[i];
+    for (unsigned int i = 0; i < n; i++)
+        lens[i] = strlen(names[i]);
+
+    sykoBenchCmdRun("cmd lookup strcmp chain", names, lens, n, 1);
+    sykoBenchCmdRun("cmd lookup perfect hash", names, lens, n, 0);
+    sykoBenchCmdRun("cmd hits strcmp chain", names, lens, commands_count - 1, 1);
+    sykoBenchCmdRun("cmd hits perfect hash", names, lens, commands_count - 1, 0);
+}
+
+/* How device-info was answered before user-007 and user-008: a tree, printed and freed */
+static size_t sykoBenchRspTree(int sequence){
+    cJSON *root = cJSON_CreateObject(), *info = cJSON_CreateObject(), *button = cJSON_CreateArray();
+    size_t len = 0;
+    char *out;
+
+    cJSON_AddItemToArray(button, cJSON_CreateString("EXIT"));
+    cJSON_AddItemToArray(button, cJSON_CreateString("DONE"));
+    cJSON_AddItemToObject(info, "button", button);
+    cJSON_AddStringToObject(info, "title", "DEVICE INFO");
+    cJSON_AddStringToObject(info, "type", "message");
+    cJSON_AddStringToObject(info, "message", "This message contains formatted text of device info.");
+    cJSON_AddItemToObject(root, "remotegui/device-info", info);
+    cJSON_AddStringToObject(root, "version", SYKO_PROTOCOL_VERSION);
+    cJSON_AddNumberToObject(root, "sequence", sequence);
+    cJSON_AddStringToObject(root, "response", "remotegui/device-info");
+    cJSON_AddStringToObject(root, "status", "ok");
+
+    out = cJSON_PrintUnformatted(root);
+    if (out) {
+        len = strlen(out);
+        memcpy(bench_rsp, out, len < sizeof(bench_rsp) ? len : sizeof(bench_rsp));
+        cJSON_free(out);
+    }
+    cJSON_Delete(root);
+
+    return len;
+}
+
+/* Through the command's template as ss_server serves it, tmpl NULL calls the handler */
+static size_t sykoBenchRspTemplate(const struct syko_template *tmpl, int sequence){
+    const struct syko_command *cmd = sykoCommandsGet(remotegui_device_info);
+    static const struct syko_request req;
+    struct syko_template_cursor cur;
+    struct syko_reply reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.sequence = sequence;
+    reply.response = cmd->name;
+    reply.status = "ok";
+    if (!tmpl) {
+        cmd->fnc(&req, &reply);
+        tmpl = sykoTemplateGet(cmd->id);
+    }
+
+    sykoTemplateBegin(&cur, &reply);
+
+    return sykoTemplateWrite(tmpl, &reply, &cur, bench_rsp, sizeof(bench_rsp));
+}
+
+/* 0 the tree, 1 the live template, 2 the constant one */
+static void sykoBenchRspRun(const char *name, int how){
+    const struct syko_template *cached = sykoTemplateConst(remotegui_device_info);
+    struct syko_bench_clock c;
+    size_t bytes = 0;
+
+    memset(&c, 0, sizeof(c));
+    sykoBenchGo(&c);
+    for (int i = 0; i < SYKO_BENCH_RSP_RUNS; i++)
+        bytes += how == 0 ? sykoBenchRspTree(i) : sykoBenchRspTemplate(how == 2 ? cached : NULL, i);
+    sykoBenchHalt(&c);
+
+    sykoBenchReport(name, &c, SYKO_BENCH_RSP_RUNS, "rsp", bytes);
+}
+
+static void sykoBenchRsp(){
+    struct syko_arena arena;
+    uint8_t live[sizeof(bench_rsp)];
+    size_t len;
+
+    if (!sykoTemplateConst(remotegui_device_info)) {
+        lwsl_err("bench: device-info has no constant reply\n");
+        return;
+    }
+
+    // The cached reply has to be byte for byte what the handler gives
+    len = sykoBenchRspTemplate(NULL, 1234);
+    memcpy(live, bench_rsp, len);
+    if (sykoBenchRspTemplate(sykoTemplateConst(remotegui_device_info), 1234) != len ||
+        memcmp(live, bench_rsp, len))
+        lwsl_warn("bench: cached device-info differs from the handler's\n");
+
+    // The arena only counts here, the timed tree runs use the heap as before
+    sykoArenaBegin(&arena);
+    sykoBenchRspTree(1);
+    sykoArenaDetach();
+    lwsl_user("bench %-36s %10u allocs/rsp %10zu bytes/rsp\n", "rsp device-info cjson tree",
+              arena.allocs, arena.bytes);
+    sykoArenaEnd(&arena);
+
+    sykoBenchRspRun("rsp device-info cjson tree", 0);
+    sykoBenchRspRun("rsp device-info template", 1);
+    sykoBenchRspRun("rsp device-info cached", 2);
+}
+
+/* A private CAN_RAW socket; the sender hears nothing, the receiver only our id */
+static int sykoBenchSocket(const char *ifname, int rx){
+    struct can_filter f = { SYKO_BENCH_CAN_ID, SYKO_CAN_MASK_EXACT(SYKO_BENCH_CAN_ID) };
+    int fd, size = 4 * 1024 * 1024;
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+
+    fd = socket(PF_CAN, SOCK_RAW | SOCK_CLOEXEC, CAN_RAW);
+    if (fd < 0)
+        return -1;
+
+    memset(&ifr, 0, sizeof(ifr));
+    lws_strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0 ||
+        setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, rx ? &f : NULL, rx ? sizeof(f) : 0) < 0)
+        goto bail;
+
+    // Capped by rmem_max, BENCH_CAN_ROUND frames fit in the default anyway
+    if (rx)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto bail;
+
+    return fd;
+
+bail:
+    lwsl_err("%s: %s: %d\n", __func__, ifname, errno);
+    close(fd);
+    return -1;
+}
+
+static void sykoBenchMsgs(struct mmsghdr *msgs, struct iovec *iov, struct can_frame *frames,
+                          int ts){
+    for (int i = 0; i < SYKO_CAN_BATCH; i++) {
+        iov[i].iov_base = &frames[i];
+        iov[i].iov_len = CAN_MTU;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = ts ? bench_rx_cmsg[i] : NULL;
+        msgs[i].msg_hdr.msg_controllen = ts ? sizeof(bench_rx_cmsg[i]) : 0;
+    }
+}
+
+/* count frames in sendmmsg() batches, untimed */
+static int sykoBenchCanBlast(int tx, unsigned long count){
+    unsigned long sent;
+    int n;
+
+    for (sent = 0; sent < count; ) {
+        n = sendmmsg(tx, bench_tx_msgs,
+                     (unsigned int)(count - sent < SYKO_CAN_BATCH ? count - sent : SYKO_CAN_BATCH), 0);
+        if (n > 0)
+            sent += (unsigned long)n;
+        else if (n < 0 && errno != ENOBUFS && errno != EINTR)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int sykoBenchCanTx(int tx){
+    struct syko_bench_clock c;
+    unsigned long sent;
+
+    memset(&c, 0, sizeof(c));
+    sykoBenchGo(&c);
+    for (sent = 0; sent < SYKO_BENCH_CAN_FRAMES; ) {
+        if (write(tx, &bench_tx_frames[0], CAN_MTU) == CAN_MTU)
+            sent++;
+        else if (errno != ENOBUFS && errno != EINTR)
+            return -1;
+    }
+    sykoBenchHalt(&c);
+    sykoBenchReport("can tx write() per frame", &c, sent, "frame", 0);
+
+    sykoBenchGo(&c);
+    if (sykoBenchCanBlast(tx, SYKO_BENCH_CAN_FRAMES))
+        return -1;
+    sykoBenchHalt(&c);
+    sykoBenchReport("can tx sendmmsg() batches", &c, SYKO_BENCH_CAN_FRAMES, "frame", 0);
+
+    return 0;
+}
+
+/* Touches the stamp as sykoCanTimestamp() would, 1 if there was one */
+static int sykoBenchStamp(struct msghdr *msg){
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+            const struct scm_timestamping *st = (const void *)CMSG_DATA(c);
+
+            return st->ts[2].tv_sec || st->ts[2].tv_nsec || st->ts[0].tv_sec || st->ts[0].tv_nsec;
+        }
+
+    return 0;
+}
+
+/* Rounds of frames from tx, drained from rx the way mode says; only the drain is timed */
+static int sykoBenchCanRx(int tx, int rx, enum syko_bench_rx mode, const char *name){
+    int flags = mode == BENCH_RX_MMSG_TS ? SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                                           SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE : 0;
+    unsigned long got = 0, sent = 0, stamped = 0;
+    struct syko_bench_clock c;
+    int n;
+
+    if (setsockopt(rx, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0 && flags)
+        lwsl_warn("bench %s: SO_TIMESTAMPING refused %d\n", name, errno);
+
+    memset(&c, 0, sizeof(c));
+    while (sent < SYKO_BENCH_CAN_FRAMES) {
+        if (sykoBenchCanBlast(tx, BENCH_CAN_ROUND))
+            return -1;
+        sent += BENCH_CAN_ROUND;
+
+        sykoBenchGo(&c);
+        for (;;) {
+            if (mode == BENCH_RX_READ) {
+                if (recv(rx, &bench_rx_frames[0], CAN_MTU, MSG_DONTWAIT) != CAN_MTU)
+                    break;
+                got++;
+                continue;
+            }
+
+            sykoBenchMsgs(bench_rx_msgs, bench_rx_iov, bench_rx_frames, mode == BENCH_RX_MMSG_TS);
+            n = recvmmsg(rx, bench_rx_msgs, SYKO_CAN_BATCH, MSG_DONTWAIT, NULL);
+            if (n <= 0)
+                break;
+            got += (unsigned long)n;
+            if (mode == BENCH_RX_MMSG_TS)
+                for (int i = 0; i < n; i++)
+                    stamped += (unsigned long)sykoBenchStamp(&bench_rx_msgs[i].msg_hdr);
+            if (n < SYKO_CAN_BATCH)
+                break;
+        }
+        sykoBenchHalt(&c);
+    }
+
+    if (got != sent || (mode == BENCH_RX_MMSG_TS && stamped != got))
+        lwsl_warn("bench %s: %lu sent, %lu received, %lu stamped\n", name, sent, got, stamped);
+    sykoBenchReport(name, &c, got, "frame", 0);
+
+    return 0;
+}
+
+static void sykoBenchCan(const char *ifname){
+    int tx = sykoBenchSocket(ifname, 0), rx = sykoBenchSocket(ifname, 1);
+
+    if (tx < 0 || rx < 0)
+        goto bail;
+
+    for (int i = 0; i < SYKO_CAN_BATCH; i++) {
+        memset(&bench_tx_frames[i], 0, sizeof(bench_tx_frames[i]));
+        bench_tx_frames[i].can_id = SYKO_BENCH_CAN_ID;
+        bench_tx_frames[i].can_dlc = CAN_MAX_DLEN;
+        memset(bench_tx_frames[i].data, i, CAN_MAX_DLEN);
+    }
+    sykoBenchMsgs(bench_tx_msgs, bench_tx_iov, bench_tx_frames, 0);
+
+    // The receiver isn't drained while we transmit, it starts out empty
+    if (sykoBenchCanTx(tx)) {
+        lwsl_err("%s: tx failed %d\n", __func__, errno);
+        goto bail;
+    }
+    while (recv(rx, &bench_rx_frames[0], CAN_MTU, MSG_DONTWAIT) > 0)
+        ;
+
+    if (sykoBenchCanRx(tx, rx, BENCH_RX_READ, "can rx read() per frame") ||
+        sykoBenchCanRx(tx, rx, BENCH_RX_MMSG, "can rx recvmmsg() batches") ||
+        sykoBenchCanRx(tx, rx, BENCH_RX_MMSG_TS, "can rx recvmmsg() + timestamps"))
+        lwsl_err("%s: rx run failed %d\n", __func__, errno);
+
+bail:
+    if (tx >= 0)
+        close(tx);
+    if (rx >= 0)
+        close(rx);
+}
+
+static void sykoBenchIsotpSend(struct syko_bench *b);
+
+static void sykoBenchRetry(lws_sorted_usec_list_t *sul){
+    sykoBenchIsotpSend(lws_container_of(sul, struct syko_bench, sul));
+}
+
+static void sykoBenchStall(lws_sorted_usec_list_t *sul){
+    struct syko_bench *b = lws_container_of(sul, struct syko_bench, sul);
+
+    lwsl_err("bench: ISO-TP run stalled after %u messages, is --vecu on %s?\n", b->msgs, b->ifname);
+    sykoBenchDone(b);
+}
+
+static void sykoBenchIsotpSent(enum syko_ecus ecu, int err, void *opaque);
+
+/* Receive runs ask for the bulk DID, the transmit run sends a full message */
+static void sykoBenchIsotpSend(struct syko_bench *b){
+    static const uint8_t did[] = { 0x22, SYKO_VECU_DID_BULK >> 8, SYKO_VECU_DID_BULK & 0xFF };
+    int n;
+
+    if (b->step < LWS_ARRAY_SIZE(bench_fc))
+        n = sykoIsotpSend(ecu_main, did, sizeof(did), NULL, NULL);
+    else
+        n = sykoIsotpSend(ecu_main, b->buf, sizeof(b->buf), sykoBenchIsotpSent, b);
+
+    // A full CAN queue drains by itself
+    if (n == -ENOBUFS) {
+        lws_sul_schedule(b->cx, 0, &b->sul, sykoBenchRetry, SYKO_CAN_RETRY_US);
+        return;
+    }
+    if (n) {
+        lwsl_err("bench: ISO-TP send failed %d\n", n);
+        sykoBenchDone(b);
+        return;
+    }
+
+    lws_sul_schedule(b->cx, 0, &b->sul, sykoBenchStall, BENCH_STALL_US);
+}
+
+static void sykoBenchIsotpNext(struct syko_bench *b){
+    b->msgs = 0;
+    b->bytes = 0;
+
+    if (b->step < LWS_ARRAY_SIZE(bench_fc))
+        sykoIsotpConfig(ecu_main, bench_fc[b->step].bs, bench_fc[b->step].stmin);
+    else {
+        sykoIsotpConfig(ecu_main, 0, 0);
+        sykoIsotpOnRx(ecu_main, NULL, NULL);
+    }
+
+    sykoBenchGo(&b->clk);
+    sykoBenchIsotpSend(b);
+}
+
+static void sykoBenchIsotpRx(enum syko_ecus ecu, const uint8_t *buf, size_t len, void *opaque){
+    struct syko_bench *b = opaque;
+    char name[48];
+
+    if (len < 3 || buf[0] != (0x22 | 0x40))
+        return;
+
+    b->bytes += len;
+    if (++b->msgs < SYKO_BENCH_ISOTP_MSGS) {
+        sykoBenchIsotpSend(b);
+        return;
+    }
+
+    sykoBenchHalt(&b->clk);
+    lws_snprintf(name, sizeof(name), "isotp rx bs %u stmin 0x%02X",
+                 bench_fc[b->step].bs, bench_fc[b->step].stmin);
+    sykoBenchReport(name, &b->clk, b->msgs, "msg", b->bytes);
+
+    b->step++;
+    sykoBenchIsotpNext(b);
+}
+
+static void sykoBenchIsotpSent(enum syko_ecus ecu, int err, void *opaque){
+    struct syko_bench *b = opaque;
+    char name[48];
+
+    if (err) {
+        lwsl_err("bench: ISO-TP transfer failed %d\n", err);
+        sykoBenchDone(b);
+        return;
+    }
+
+    b->bytes += sizeof(b->buf);
+    if (++b->msgs < SYKO_BENCH_ISOTP_MSGS) {
+        sykoBenchIsotpSend(b);
+        return;
+    }
+
+    sykoBenchHalt(&b->clk);
+    lws_snprintf(name, sizeof(name), "isotp tx (vecu bs %u stmin 0x%02X)", SYKO_VECU_BS, SYKO_VECU_STMIN);
+    sykoBenchReport(name, &b->clk, b->msgs, "msg", b->bytes);
+
+    sykoBenchDone(b);
+}
+
+/* From the loop once it is up, so the CAN sockets and timers are live */
+static void sykoBenchRun(lws_sorted_usec_list_t *sul){
+    struct syko_bench *b = lws_container_of(sul, struct syko_bench, sul);
+    enum syko_can_ifs bus = sykoIsotpEcu(ecu_main)->bus;
+
+    if (b->what & BENCH_CMD)
+        sykoBenchCmd();
+
+    if (b->what & BENCH_RSP)
+        sykoBenchRsp();
+
+    if (b->what & BENCH_JSON)
+        sykoBenchJson();
+
+    if (b->what & BENCH_CAN)
+        sykoBenchCan(b->ifname);
+
+    if (!(b->what & BENCH_ISOTP)) {
+        sykoBenchDone(b);
+        return;
+    }
+
+    if (strcmp(b->ifname, sykoCanName(bus)) || !sykoCanUp(bus)) {
+        lwsl_err("bench: isotp needs --vecu on %s and the interface up\n", sykoCanName(bus));
+        sykoBenchDone(b);
+        return;
+    }
+
+    sykoIsotpOnRx(ecu_main, sykoBenchIsotpRx, b);
+    b->step = 0;
+    sykoBenchIsotpNext(b);
+}
+
+/* what is cmd, rsp, json, can, isotp or all. can and isotp need --vecu */
+int sykoBenchStart(struct lws_context *cx, const char *ifname, const char *what){
+    memset(&bench, 0, sizeof(bench));
+
+    if (!strcmp(what, "cmd"))
+        bench.what = BENCH_CMD;
+    else if (!strcmp(what, "rsp"))
+        bench.what = BENCH_RSP;
+    else if (!strcmp(what, "json"))
+        bench.what = BENCH_JSON;
+    else if (!strcmp(what, "can"))
+        bench.what = BENCH_CAN;
+    else if (!strcmp(what, "isotp"))
+        bench.what = BENCH_ISOTP;
+    else if (!strcmp(what, "all"))
+        bench.what = BENCH_CMD | BENCH_RSP | BENCH_JSON | BENCH_CAN | BENCH_ISOTP;
+    else {
+        lwsl_err("%s: no benchmark %s, cmd, rsp, json, can, isotp or all\n", __func__, what);
+        return 1;
+    }
+
+    if ((bench.what & (BENCH_CAN | BENCH_ISOTP)) && !ifname) {
+        lwsl_err("%s: %s needs --vecu\n", __func__, what);
+        return 1;
+    }
+
+    bench.cx = cx;
+    bench.ifname = ifname;
+
+    // Suppressed TesterPresent, the virtual ECU takes it in and stays quiet
+    bench.buf[0] = 0x3E;
+    bench.buf[1] = 0x80;
+    memset(bench.buf + 2, 0x55, sizeof(bench.buf) - 2);
+
+    lws_sul_schedule(cx, 0, &bench.sul, sykoBenchRun, 1);
+
+    return 0;
+}
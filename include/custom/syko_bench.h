@@ -0,0 +1,42 @@
+#ifndef SYKO_BENCH_H
+#define SYKO_BENCH_H
+
+#include <libwebsockets.h>
+
+/*
+ * Benchmarks for the CAN and request paths, run against the virtual ECU
+ * on a vcan interface instead of serving clients, e.g.
+ *
+ *   ip link add dev can0 type vcan && ip link set can0 up
+ *   ./main --vecu can0 --bench all
+ *
+ * Each result is a rate over wall time and the CPU the service thread
+ * spent per item, so the same run can be compared across machines.
+ *
+ *   cmd    command lookup by perfect hash against the strcmp() chain it
+ *          replaced, over every command in the table plus some misses
+ *   rsp    remotegui/device-info built as a cJSON tree and printed, as
+ *          it was before templates, against its template with the handler
+ *          called and against its constant reply rendered at startup
+ *   json   cJSON tree against the streaming decoder, for a small request
+ *          and a 64 KiB one, the latter also fed in segment sized pieces
+ *   can    per frame write() against sendmmsg() batches, and per frame
+ *          read() against recvmmsg() with and without SO_TIMESTAMPING,
+ *          on private sockets set up the way syko_can sets up its own
+ *   isotp  ISO-TP transfers of SYKO_ISOTP_MAX bytes to and from the main
+ *          ECU, receiving at several BS / STmin we advertise
+ *
+ * Run the virtual ECU without --vecu-latency or --vecu-loss. The loop
+ * exits when the benchmarks are done.
+ */
+#define SYKO_BENCH_CMD_RUNS     200000  // Passes over the command names
+#define SYKO_BENCH_RSP_RUNS     100000
+#define SYKO_BENCH_JSON_RUNS    20000   // Small requests, the 64 KiB one runs a hundredth
+#define SYKO_BENCH_JSON_SEGMENT 1400    // Piece size for the split request
+#define SYKO_BENCH_CAN_FRAMES   200000
+#define SYKO_BENCH_CAN_ID       0x7F0   // No ECU of ours, nothing answers it
+#define SYKO_BENCH_ISOTP_MSGS   20      // Per BS / STmin setting
+
+int sykoBenchStart(struct lws_context *cx, const char *ifname, const char *what);
+
+#endif
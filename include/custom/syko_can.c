@@ -0,0 +1,543 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // sendmmsg, recvmmsg
+#endif
+#include "syko_can.h"
+#include "syko_isotp.h"
+#include "syko_canmon.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Kernel receive filter entry, with the number of users
+struct syko_can_filter {
+    canid_t id, mask;
+    unsigned int refs;
+};
+
+// Frames waiting for the socket to become writable, fd says which size
+struct syko_can_txq {
+    struct canfd_frame frames[SYKO_CAN_TXQ_LEN];
+    uint8_t fd[SYKO_CAN_TXQ_LEN];
+    unsigned int head, tail;
+};
+
+struct syko_can_if {
+    const char *name;
+    unsigned int flags;
+    int fd;
+    int fd_frames;                  // CAN_RAW_FD_FRAMES is on
+    int ts_mode;                    // SO_TIMESTAMPING, SO_TIMESTAMPNS or 0
+    struct lws *wsi;
+
+    struct syko_can_txq txq[syko_can_prio_count];
+    lws_sorted_usec_list_t retry;   // ENOBUFS backoff
+    uint8_t backoff;
+
+    struct syko_can_filter filters[SYKO_CAN_FILTERS_MAX];
+    int filter_count;
+
+    struct syko_can_stats stats;
+};
+
+static struct syko_can_if can_ifs[] = {
+#define SYKO_CAN_IF_ENTRY(id, ifname, ifflags) { .name = ifname, .flags = ifflags, .fd = -1 },
+    SYKO_CAN_IFS(SYKO_CAN_IF_ENTRY)
+#undef SYKO_CAN_IF_ENTRY
+};
+
+// Batch I/O scratch shared by all interfaces, the loop only runs one at a time
+static struct mmsghdr can_tx_msgs[SYKO_CAN_BATCH];
+static struct iovec can_tx_iov[SYKO_CAN_BATCH];
+static struct mmsghdr can_rx_msgs[SYKO_CAN_BATCH];
+static struct iovec can_rx_iov[SYKO_CAN_BATCH];
+static struct canfd_frame can_rx_frames[SYKO_CAN_BATCH];
+static uint8_t can_rx_cmsg[SYKO_CAN_BATCH][CMSG_SPACE(sizeof(struct scm_timestamping))];
+
+static enum syko_can_ifs sykoCanIndex(const struct syko_can_if *cif){
+    return (enum syko_can_ifs)(cif - can_ifs);
+}
+
+/* Rebuilds CAN_RAW_FILTER from the table, an empty table receives nothing */
+static int sykoCanFilterApply(struct syko_can_if *cif){
+    struct can_filter f[SYKO_CAN_FILTERS_MAX];
+
+    for (int i = 0; i < cif->filter_count; i++) {
+        f[i].can_id = cif->filters[i].id;
+        f[i].can_mask = cif->filters[i].mask;
+    }
+
+    if (setsockopt(cif->fd, SOL_CAN_RAW, CAN_RAW_FILTER, cif->filter_count ? f : NULL,
+                   (socklen_t)(sizeof(f[0]) * (size_t)cif->filter_count)) < 0) {
+        lwsl_err("%s: %s CAN_RAW_FILTER failed %d\n", __func__, cif->name, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* FD needs both an FD capable interface (CANFD_MTU) and the socket option */
+static void sykoCanFdEnable(struct syko_can_if *cif, struct ifreq *ifr){
+    int on = 1;
+
+    cif->fd_frames = 0;
+
+    if (ioctl(cif->fd, SIOCGIFMTU, ifr) < 0 || ifr->ifr_mtu != CANFD_MTU) {
+        lwsl_user("CAN FD not supported by %s, using classic CAN\n", ifr->ifr_name);
+        return;
+    }
+
+    if (setsockopt(cif->fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on)) < 0) {
+        lwsl_user("CAN FD frames refused by %s, using classic CAN\n", cif->name);
+        return;
+    }
+
+    cif->fd_frames = 1;
+}
+
+/*
+ * Ask the kernel to stamp received frames: the controller's hardware clock
+ * if the driver has one, else the kernel's own rx time, which is still
+ * taken when the frame arrives rather than when we get round to reading.
+ */
+static void sykoCanTimestampEnable(struct syko_can_if *cif){
+    int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    int on = 1;
+
+    if (!setsockopt(cif->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) {
+        cif->ts_mode = SO_TIMESTAMPING;
+        return;
+    }
+
+    if (!setsockopt(cif->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on))) {
+        cif->ts_mode = SO_TIMESTAMPNS;
+        return;
+    }
+
+    cif->ts_mode = 0;
+    lwsl_user("%s rx timestamps not available, using read time\n", cif->name);
+}
+
+/* Nanoseconds from the rx control messages, hardware stamp preferred */
+static uint64_t sykoCanTimestamp(struct msghdr *msg, enum syko_can_ts_src *src){
+    const struct timespec *ts = NULL;
+    struct timespec now;
+    struct cmsghdr *c;
+
+    for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET)
+            continue;
+
+        if (c->cmsg_type == SCM_TIMESTAMPING) {
+            const struct scm_timestamping *st = (const void *)CMSG_DATA(c);
+
+            if (st->ts[2].tv_sec || st->ts[2].tv_nsec) {
+                ts = &st->ts[2];
+                *src = syko_can_ts_hw;
+            } else {
+                ts = &st->ts[0];
+                *src = syko_can_ts_sw;
+            }
+            break;
+        }
+        if (c->cmsg_type == SCM_TIMESTAMPNS) {
+            ts = (const void *)CMSG_DATA(c);
+            *src = syko_can_ts_sw;
+            break;
+        }
+    }
+
+    // Same clock as the kernel's software stamps
+    if (!ts) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        ts = &now;
+        *src = syko_can_ts_read;
+    }
+
+    return (uint64_t)ts->tv_sec * 1000000000ull + (uint64_t)ts->tv_nsec;
+}
+
+static int sykoCanOpen(struct syko_can_if *cif){
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+
+    cif->fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+    if (cif->fd < 0){
+        lwsl_user("Socket open error\n");
+        return 1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    lws_strncpy(ifr.ifr_name, cif->name, sizeof(ifr.ifr_name));
+    if (ioctl(cif->fd, SIOCGIFINDEX, &ifr) < 0) {
+        lwsl_user("CAN interface %s not found\n", cif->name);
+        goto bail;
+    }
+
+    if (cif->flags & SYKO_CAN_IF_F_FD)
+        sykoCanFdEnable(cif, &ifr);
+
+    sykoCanTimestampEnable(cif);
+
+    // Nothing wakes us until someone asks for an id
+    cif->filter_count = 0;
+    if (sykoCanFilterApply(cif))
+        goto bail;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+
+    if (bind(cif->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        lwsl_user("Binding CAN error\n");
+        goto bail;
+    }
+
+    lwsl_user("Succesfuly started %s%s\n", cif->name, cif->fd_frames ? " (FD)" : "");
+    return 0;
+
+bail:
+    close(cif->fd);
+    cif->fd = -1;
+    return 1;
+}
+
+/* Opens every configured interface, only the optional ones may be missing */
+int sykoCanInit(){
+    for (int i = 0; i < syko_can_ifs_count; i++)
+        if (sykoCanOpen(&can_ifs[i]) && !(can_ifs[i].flags & SYKO_CAN_IF_F_OPTIONAL))
+            return 1;
+
+    return 0;
+}
+
+/* From here on lws owns the descriptors and closes them with their wsi */
+int sykoCanAdopt(struct lws_vhost *vh){
+    lws_sock_file_fd_type fd;
+
+    for (int i = 0; i < syko_can_ifs_count; i++) {
+        struct syko_can_if *cif = &can_ifs[i];
+
+        if (cif->fd < 0)
+            continue;
+
+        fd.filefd = cif->fd;
+        cif->wsi = lws_adopt_descriptor_vhost(vh, LWS_ADOPT_RAW_FILE_DESC, fd, "syko-loop", NULL);
+        if (!cif->wsi) {
+            lwsl_err("%s: %s adoption failed\n", __func__, cif->name);
+            return 1;
+        }
+        lws_set_opaque_user_data(cif->wsi, cif);
+    }
+
+    return 0;
+}
+
+static void sykoCanRx(struct syko_can_if *cif, const struct canfd_frame *frame, int fd,
+                      uint64_t ts, enum syko_can_ts_src src){
+    enum syko_can_ifs bus = sykoCanIndex(cif);
+    char hex[CANFD_MAX_DLEN * 3 + 1];
+    int n = 0;
+
+    cif->stats.rx_frames++;
+    sykoCanMonPush(bus, frame, fd, ts, src);
+
+    // Monitoring opens the filter to the whole bus, so other frames are only traced
+    if (sykoIsotpRx(bus, frame, fd) || !lwsl_visible(LLL_DEBUG))
+        return;
+
+    for (int i = 0; i < frame->len && i < CANFD_MAX_DLEN; i++)
+        n += lws_snprintf(hex + n, sizeof(hex) - (size_t)n, "%02X ", frame->data[i]);
+    hex[n] = '\0';
+
+    lwsl_debug("Recibido %s ID: 0x%X, DLC: %d, Data: %s\n", cif->name, frame->can_id, frame->len, hex);
+}
+
+static int sykoCanReadable(struct syko_can_if *cif){
+    enum syko_can_ts_src src;
+    uint64_t ts;
+    int n;
+
+    // Drain everything the kernel has queued, the fd is level triggered
+    do {
+        for (int i = 0; i < SYKO_CAN_BATCH; i++) {
+            can_rx_iov[i].iov_base = &can_rx_frames[i];
+            can_rx_iov[i].iov_len = sizeof(can_rx_frames[i]);
+            can_rx_msgs[i].msg_hdr.msg_iov = &can_rx_iov[i];
+            can_rx_msgs[i].msg_hdr.msg_iovlen = 1;
+            can_rx_msgs[i].msg_hdr.msg_control = cif->ts_mode ? can_rx_cmsg[i] : NULL;
+            can_rx_msgs[i].msg_hdr.msg_controllen = cif->ts_mode ? sizeof(can_rx_cmsg[i]) : 0;
+        }
+
+        n = recvmmsg(cif->fd, can_rx_msgs, SYKO_CAN_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            cif->stats.rx_errors++;
+            lwsl_err("%s: %s read error %d\n", __func__, cif->name, errno);
+            return -1;
+        }
+
+        // struct can_frame is a prefix of struct canfd_frame
+        for (int i = 0; i < n; i++) {
+            if (can_rx_msgs[i].msg_len != CAN_MTU && can_rx_msgs[i].msg_len != CANFD_MTU)
+                continue;
+            ts = sykoCanTimestamp(&can_rx_msgs[i].msg_hdr, &src);
+            sykoCanRx(cif, &can_rx_frames[i], can_rx_msgs[i].msg_len == CANFD_MTU, ts, src);
+        }
+    } while (n == SYKO_CAN_BATCH);
+
+    sykoCanMonWake(sykoCanIndex(cif));
+
+    return 0;
+}
+
+static unsigned int sykoCanTxqDepth(const struct syko_can_txq *q){
+    return q->head - q->tail;
+}
+
+static void sykoCanRetry(lws_sorted_usec_list_t *sul){
+    struct syko_can_if *cif = lws_container_of(sul, struct syko_can_if, retry);
+
+    cif->backoff = 0;
+    if (cif->wsi)
+        lws_callback_on_writable(cif->wsi);
+}
+
+/* Writes one queue until it is empty (0), the socket (EAGAIN) or qdisc (ENOBUFS) pushes back, or fails */
+static int sykoCanTxDrain(struct syko_can_if *cif, struct syko_can_txq *q){
+    unsigned int i, count;
+    int n;
+
+    while (q->tail != q->head) {
+        // One batch never wraps the ring, the next loop picks up the rest
+        i = q->tail & (SYKO_CAN_TXQ_LEN - 1);
+        count = q->head - q->tail;
+        if (count > SYKO_CAN_TXQ_LEN - i)
+            count = SYKO_CAN_TXQ_LEN - i;
+        if (count > SYKO_CAN_BATCH)
+            count = SYKO_CAN_BATCH;
+
+        for (unsigned int k = 0; k < count; k++) {
+            can_tx_iov[k].iov_base = &q->frames[i + k];
+            can_tx_iov[k].iov_len = q->fd[i + k] ? CANFD_MTU : CAN_MTU;
+            memset(&can_tx_msgs[k].msg_hdr, 0, sizeof(can_tx_msgs[k].msg_hdr));
+            can_tx_msgs[k].msg_hdr.msg_iov = &can_tx_iov[k];
+            can_tx_msgs[k].msg_hdr.msg_iovlen = 1;
+        }
+
+        // A short count means the next frame would have failed, it is retried from there
+        n = sendmmsg(cif->fd, can_tx_msgs, count, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return EAGAIN;
+            if (errno == ENOBUFS) {
+                cif->stats.tx_nobufs++;
+                return ENOBUFS;
+            }
+            cif->stats.tx_errors++;
+            lwsl_err("%s: %s write error %d\n", __func__, cif->name, errno);
+            return -1;
+        }
+
+        q->tail += (unsigned int)n;
+        cif->stats.tx_frames += (unsigned int)n;
+    }
+
+    return 0;
+}
+
+static int sykoCanWriteable(struct syko_can_if *cif){
+    int n = 0;
+
+    if (cif->backoff)
+        return 0;
+
+    // Stop at the first queue the socket refuses, lower priorities wait for it
+    for (int p = 0; p < syko_can_prio_count && !n; p++)
+        n = sykoCanTxDrain(cif, &cif->txq[p]);
+
+    if (n < 0)
+        return -1;
+
+    if (n == ENOBUFS) {
+        cif->backoff = 1;
+        lws_sul_schedule(lws_get_context(cif->wsi), 0, &cif->retry, sykoCanRetry, SYKO_CAN_RETRY_US);
+    } else if (n)
+        lws_callback_on_writable(cif->wsi);
+
+    // Refill the bulk queue before it runs dry rather than after
+    if (sykoCanTxqDepth(&cif->txq[SYKO_CAN_PRIO_BULK]) <= SYKO_CAN_TXQ_LEN / 2)
+        sykoIsotpTxSpace(sykoCanIndex(cif));
+
+    return 0;
+}
+
+int sykoCanCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                    void *user, void *in, size_t len){
+    struct syko_can_if *cif = lws_get_opaque_user_data(wsi);
+
+    if (!cif)
+        return 0;
+
+    switch (reason) {
+    case LWS_CALLBACK_RAW_RX_FILE:
+        return sykoCanReadable(cif);
+
+    case LWS_CALLBACK_RAW_WRITEABLE_FILE:
+        return sykoCanWriteable(cif);
+
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
+        lws_sul_cancel(&cif->retry);
+        cif->backoff = 0;
+        for (int p = 0; p < syko_can_prio_count; p++) {
+            cif->stats.tx_dropped += sykoCanTxqDepth(&cif->txq[p]);
+            cif->txq[p].head = cif->txq[p].tail = 0;
+        }
+
+        lwsl_user("%s closed: rx %llu tx %llu frames, tx queue full %llu times, "
+                  "ENOBUFS %llu, dropped %llu, peak depth %llu\n", cif->name,
+                  (unsigned long long)cif->stats.rx_frames, (unsigned long long)cif->stats.tx_frames,
+                  (unsigned long long)cif->stats.tx_full, (unsigned long long)cif->stats.tx_nobufs,
+                  (unsigned long long)cif->stats.tx_dropped, (unsigned long long)cif->stats.txq_peak);
+        cif->wsi = NULL;
+        cif->fd = -1;
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+int sykoCanSend(enum syko_can_ifs bus, const struct canfd_frame *frame, int fd,
+                enum syko_can_prio prio){
+    struct syko_can_if *cif = &can_ifs[bus];
+    struct syko_can_txq *q = &cif->txq[prio];
+    unsigned int i, depth;
+
+    if (!cif->wsi || (fd && !cif->fd_frames))
+        return -1;
+
+    if (sykoCanTxqDepth(q) >= SYKO_CAN_TXQ_LEN) {
+        cif->stats.tx_full++;
+        return -1;
+    }
+
+    i = q->head++ & (SYKO_CAN_TXQ_LEN - 1);
+    q->frames[i] = *frame;
+    q->fd[i] = (uint8_t)!!fd;
+
+    depth = sykoCanTxDepth(bus);
+    if (depth > cif->stats.txq_peak)
+        cif->stats.txq_peak = depth;
+
+    // During a backoff the retry timer asks for POLLOUT
+    if (!cif->backoff)
+        lws_callback_on_writable(cif->wsi);
+
+    return 0;
+}
+
+int sykoCanFd(enum syko_can_ifs bus){
+    return can_ifs[bus].fd_frames;
+}
+
+int sykoCanUp(enum syko_can_ifs bus){
+    return can_ifs[bus].wsi != NULL;
+}
+
+const char * sykoCanName(enum syko_can_ifs bus){
+    return can_ifs[bus].name;
+}
+
+const char * sykoCanTsName(enum syko_can_ts_src src){
+    static const char * const names[] = {
+#define SYKO_CAN_TS_NAME(id, name) name,
+        SYKO_CAN_TS_SRCS(SYKO_CAN_TS_NAME)
+#undef SYKO_CAN_TS_NAME
+    };
+
+    return names[src];
+}
+
+/* Interface by its ifname, -1 if there is no such one */
+int sykoCanLookup(const char *name){
+    for (int i = 0; i < syko_can_ifs_count; i++)
+        if (!strcmp(can_ifs[i].name, name))
+            return i;
+
+    return -1;
+}
+
+const struct syko_can_stats * sykoCanStats(enum syko_can_ifs bus){
+    return &can_ifs[bus].stats;
+}
+
+/* Frames queued for the bus, all priorities */
+unsigned int sykoCanTxDepth(enum syko_can_ifs bus){
+    unsigned int depth = 0;
+
+    for (int p = 0; p < syko_can_prio_count; p++)
+        depth += sykoCanTxqDepth(&can_ifs[bus].txq[p]);
+
+    return depth;
+}
+
+/*
+ * Filters are reference counted, so several sessions on one ECU share an
+ * entry and the kernel filter only changes when an id comes or goes. The
+ * mask has CAN_RAW_FILTER semantics, SYKO_CAN_MASK_EXACT() matches one id.
+ */
+int sykoCanFilterAdd(enum syko_can_ifs bus, canid_t id, canid_t mask){
+    struct syko_can_if *cif = &can_ifs[bus];
+
+    if (cif->fd < 0)
+        return -1;
+
+    for (int i = 0; i < cif->filter_count; i++)
+        if (cif->filters[i].id == id && cif->filters[i].mask == mask) {
+            cif->filters[i].refs++;
+            return 0;
+        }
+
+    if (cif->filter_count == SYKO_CAN_FILTERS_MAX) {
+        lwsl_err("%s: %s has no room for id 0x%X/0x%X\n", __func__, cif->name, id, mask);
+        return -1;
+    }
+
+    cif->filters[cif->filter_count].id = id;
+    cif->filters[cif->filter_count].mask = mask;
+    cif->filters[cif->filter_count].refs = 1;
+    cif->filter_count++;
+
+    // Drop the entry again and put the old table back on the socket
+    if (sykoCanFilterApply(cif)) {
+        cif->filter_count--;
+        sykoCanFilterApply(cif);
+        return -1;
+    }
+
+    return 0;
+}
+
+void sykoCanFilterRemove(enum syko_can_ifs bus, canid_t id, canid_t mask){
+    struct syko_can_if *cif = &can_ifs[bus];
+
+    for (int i = 0; i < cif->filter_count; i++)
+        if (cif->filters[i].id == id && cif->filters[i].mask == mask) {
+            if (--cif->filters[i].refs)
+                return;
+
+            cif->filters[i] = cif->filters[--cif->filter_count];
+            if (cif->fd >= 0)
+                sykoCanFilterApply(cif);
+            return;
+        }
+}
@@ -0,0 +1,111 @@
+#ifndef SYKO_CAN_H
+#define SYKO_CAN_H
+
+#include <libwebsockets.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+/*
+ * CAN interfaces: X(id, ifname, flags). Each one has its own CAN_RAW
+ * socket, non-blocking and adopted into the lws loop as a raw file on the
+ * syko-loop vhost, with its own tx queue, kernel filter, monitor ring and
+ * statistics. ECUs (see syko_isotp.h) and commands pick an interface by id
+ * or by ifname, so separate buses never serialize through one socket.
+ *
+ * Received frames and writability arrive as ordinary lws callbacks on the
+ * service thread, so nothing here may be called from a worker. Outgoing
+ * frames are queued and written as the socket allows, up to SYKO_CAN_BATCH
+ * per sendmmsg(); reads are drained the same way with recvmmsg(). Frames
+ * on our ECUs' ids go to ISO-TP.
+ *
+ * There is one bounded tx queue per priority and the higher one always
+ * goes first, so flow control and first frames never wait behind a
+ * flash transfer's consecutive frames. A full queue refuses the frame and
+ * the caller resumes from sykoIsotpTxSpace(). When the qdisc pushes back
+ * with ENOBUFS the socket still polls writable, so instead of spinning on
+ * POLLOUT we retry after SYKO_CAN_RETRY_US, from the frame that failed.
+ *
+ * Frames are always carried as struct canfd_frame, with fd saying whether
+ * it goes on the wire as CAN FD or as a classic frame. FD is only used if
+ * the interface and the socket both accept it, see sykoCanFd().
+ *
+ * A socket only receives ids someone registered with sykoCanFilterAdd(),
+ * the kernel drops everything else before it can wake us.
+ *
+ * Received frames carry a nanosecond rx timestamp from SO_TIMESTAMPING
+ * (hardware if the controller stamps, else kernel software) or
+ * SO_TIMESTAMPNS, read from the recvmmsg() control messages, and which of
+ * those it was. Hardware stamps count in the controller's own clock, the
+ * others are CLOCK_REALTIME, so only stamps from one source compare.
+ */
+#define SYKO_CAN_IF_F_FD        (1u << 0)   // Try CAN FD, falls back to classic
+#define SYKO_CAN_IF_F_OPTIONAL  (1u << 1)   // Carry on without it if it is missing
+
+#define SYKO_CAN_IFS(X) \
+    X(can_powertrain, "can0", SYKO_CAN_IF_F_FD) \
+    X(can_body,       "can1", SYKO_CAN_IF_F_FD | SYKO_CAN_IF_F_OPTIONAL)
+
+enum syko_can_ifs {
+#define SYKO_CAN_IF_ENUM(id, ifname, flags) id,
+    SYKO_CAN_IFS(SYKO_CAN_IF_ENUM)
+#undef SYKO_CAN_IF_ENUM
+    syko_can_ifs_count
+};
+
+#define SYKO_CAN_TX_ID      0x123
+#define SYKO_CAN_TXQ_LEN    64      // Frames per priority, power of two
+#define SYKO_CAN_BATCH      32      // Frames per sendmmsg / recvmmsg
+#define SYKO_CAN_FILTERS_MAX 16     // Distinct id/mask pairs in CAN_RAW_FILTER
+#define SYKO_CAN_RETRY_US   (1 * LWS_US_PER_MS)     // Backoff after ENOBUFS
+
+// Where a frame's rx timestamp came from: X(id, name)
+#define SYKO_CAN_TS_SRCS(X) \
+    X(syko_can_ts_hw,   "hw")   /* Controller clock */ \
+    X(syko_can_ts_sw,   "sw")   /* Kernel rx, CLOCK_REALTIME */ \
+    X(syko_can_ts_read, "read") /* No stamp, our read, CLOCK_REALTIME */
+
+enum syko_can_ts_src {
+#define SYKO_CAN_TS_ENUM(id, name) id,
+    SYKO_CAN_TS_SRCS(SYKO_CAN_TS_ENUM)
+#undef SYKO_CAN_TS_ENUM
+    syko_can_ts_src_count
+};
+
+enum syko_can_prio {
+    SYKO_CAN_PRIO_CTRL,     // Flow control, single and first frames
+    SYKO_CAN_PRIO_BULK,     // Consecutive frames
+    syko_can_prio_count
+};
+
+// Filter mask that matches exactly one SFF or EFF (CAN_EFF_FLAG) data frame id
+#define SYKO_CAN_MASK_EXACT(id) \
+    (CAN_EFF_FLAG | CAN_RTR_FLAG | (((id) & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK))
+
+struct syko_can_stats {
+    uint64_t rx_frames;
+    uint64_t tx_frames;
+    uint64_t tx_full;       // Sends refused because the tx queue was full
+    uint64_t tx_nobufs;     // Writes the qdisc pushed back with ENOBUFS
+    uint64_t tx_dropped;    // Queued frames lost when the interface closed
+    uint64_t txq_peak;      // Deepest the tx queues have been, all priorities
+    uint64_t rx_errors;
+    uint64_t tx_errors;
+};
+
+int sykoCanInit();
+int sykoCanAdopt(struct lws_vhost *vh);
+int sykoCanCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                    void *user, void *in, size_t len);
+int sykoCanUp(enum syko_can_ifs bus);
+int sykoCanFd(enum syko_can_ifs bus);
+const char * sykoCanName(enum syko_can_ifs bus);
+const char * sykoCanTsName(enum syko_can_ts_src src);
+int sykoCanLookup(const char *name);
+const struct syko_can_stats * sykoCanStats(enum syko_can_ifs bus);
+unsigned int sykoCanTxDepth(enum syko_can_ifs bus);
+int sykoCanSend(enum syko_can_ifs bus, const struct canfd_frame *frame, int fd,
+                enum syko_can_prio prio);
+int sykoCanFilterAdd(enum syko_can_ifs bus, canid_t id, canid_t mask);
+void sykoCanFilterRemove(enum syko_can_ifs bus, canid_t id, canid_t mask);
+
+#endif
@@ -0,0 +1,198 @@
+#include "syko_canmon.h"
+#include "syko_handler.h"
+
+struct syko_can_rec {
+    struct canfd_frame frame;
+    uint64_t ts;            // rx time, ns
+    uint8_t ts_src;         // enum syko_can_ts_src, says which clock ts is in
+    uint8_t fd;
+};
+
+// One ring and subscriber list per CAN interface
+struct syko_canmon {
+    struct lws_ring *ring;
+    lws_dll2_owner_t subs;
+};
+
+static struct syko_canmon canmon[syko_can_ifs_count];
+
+int sykoCanMonInit(){
+    for (int i = 0; i < syko_can_ifs_count; i++) {
+        canmon[i].ring = lws_ring_create(sizeof(struct syko_can_rec), SYKO_CANMON_RING, NULL);
+        if (!canmon[i].ring) {
+            lwsl_err("%s: ring alloc failed\n", __func__);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void sykoCanMonDestroy(){
+    for (int i = 0; i < syko_can_ifs_count; i++) {
+        lws_start_foreach_dll_safe(struct lws_dll2 *, d, d1, lws_dll2_get_head(&canmon[i].subs)) {
+            lws_dll2_remove(d);
+        } lws_end_foreach_dll_safe(d, d1);
+
+        lws_ring_destroy(canmon[i].ring);
+        canmon[i].ring = NULL;
+    }
+}
+
+/* The ring may only reuse what the furthest behind subscriber has read */
+static void sykoCanMonOldest(struct syko_canmon *m){
+    struct syko_can_sub *oldest = NULL;
+    size_t n, most = 0;
+
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&m->subs)) {
+        struct syko_can_sub *sub = lws_container_of(d, struct syko_can_sub, list);
+
+        n = lws_ring_get_count_waiting_elements(m->ring, &sub->tail);
+        if (!oldest || n > most) {
+            oldest = sub;
+            most = n;
+        }
+    } lws_end_foreach_dll(d);
+
+    if (oldest)
+        lws_ring_update_oldest_tail(m->ring, oldest->tail);
+    else
+        lws_ring_consume(m->ring, NULL, NULL,
+                         lws_ring_get_count_waiting_elements(m->ring, NULL));
+}
+
+/* Ring full: whoever sits on the oldest tail skips to the head */
+static void sykoCanMonCull(struct syko_canmon *m){
+    size_t full = lws_ring_get_count_waiting_elements(m->ring, NULL);
+
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&m->subs)) {
+        struct syko_can_sub *sub = lws_container_of(d, struct syko_can_sub, list);
+
+        if (lws_ring_get_count_waiting_elements(m->ring, &sub->tail) == full) {
+            sub->lost += (unsigned int)full;
+            lws_ring_consume(m->ring, &sub->tail, NULL, full);
+        }
+    } lws_end_foreach_dll(d);
+
+    sykoCanMonOldest(m);
+}
+
+void sykoCanMonPush(enum syko_can_ifs bus, const struct canfd_frame *frame, int fd,
+                    uint64_t ts, enum syko_can_ts_src src){
+    struct syko_canmon *m = &canmon[bus];
+    struct syko_can_rec rec;
+
+    if (!m->subs.count)
+        return;
+
+    if (!lws_ring_get_count_free_elements(m->ring))
+        sykoCanMonCull(m);
+
+    rec.frame = *frame;
+    rec.ts = ts;
+    rec.ts_src = (uint8_t)src;
+    rec.fd = (uint8_t)fd;
+    lws_ring_insert(m->ring, &rec, 1);
+}
+
+/* After a batch of pushes, let subscribers with frames waiting know */
+void sykoCanMonWake(enum syko_can_ifs bus){
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&canmon[bus].subs)) {
+        struct syko_can_sub *sub = lws_container_of(d, struct syko_can_sub, list);
+
+        if (sub->wake && sykoCanMonPending(sub))
+            sub->wake(sub);
+    } lws_end_foreach_dll(d);
+}
+
+/* A new subscriber starts at the head, it does not see older frames */
+int sykoCanMonSubscribe(struct syko_can_sub *sub, enum syko_can_ifs bus,
+                        canid_t id, canid_t mask, unsigned int flags){
+    struct syko_canmon *m = &canmon[bus];
+
+    if (!m->ring)
+        return -1;
+
+    if (sub->list.owner)
+        sykoCanMonUnsubscribe(sub);
+
+    if (sykoCanFilterAdd(bus, id, mask))
+        return -1;
+
+    sub->bus = bus;
+    sub->id = id;
+    sub->mask = mask;
+    sub->flags = flags;
+    sub->lost = 0;
+    sub->tail = lws_ring_get_oldest_tail(m->ring);
+    lws_ring_consume(m->ring, &sub->tail, NULL,
+                     lws_ring_get_count_waiting_elements(m->ring, &sub->tail));
+    lws_dll2_add_tail(&sub->list, &m->subs);
+
+    return 0;
+}
+
+void sykoCanMonUnsubscribe(struct syko_can_sub *sub){
+    if (!sub->list.owner)
+        return;
+
+    lws_dll2_remove(&sub->list);
+    sykoCanFilterRemove(sub->bus, sub->id, sub->mask);
+    sykoCanMonOldest(&canmon[sub->bus]);
+}
+
+int sykoCanMonPending(struct syko_can_sub *sub){
+    return sub->list.owner && (sub->lost ||
+           lws_ring_get_count_waiting_elements(canmon[sub->bus].ring, &sub->tail));
+}
+
+/*
+ * One complete message with as many of the subscriber's waiting frames as
+ * fit, frames outside its filter are skipped. Returns 0 if there was
+ * nothing to send or the window is too small to be worth it.
+ */
+size_t sykoCanMonWrite(struct syko_can_sub *sub, uint8_t *buf, size_t len){
+    // Worst case per frame: 29 bit id, timestamp and its source, 64 data bytes as hex
+    const size_t frame_max = 96 + CANFD_MAX_DLEN * 2;
+    const size_t tail_max = 128;
+    struct syko_canmon *m = &canmon[sub->bus];
+    const struct syko_can_rec *rec;
+    char *p = (char *)buf, *end = (char *)buf + len;
+    int first = 1;
+
+    if (len < SYKO_CANMON_MSG_MIN || !sykoCanMonPending(sub))
+        return 0;
+
+    p += lws_snprintf(p, lws_ptr_diff_size_t(end, p), "{\"bus\":\"%s\",\"remotegui/can-frames\":[",
+                      sykoCanName(sub->bus));
+
+    while ((size_t)(end - p) > frame_max + tail_max &&
+           (rec = lws_ring_get_element(m->ring, &sub->tail))) {
+        if ((rec->frame.can_id & sub->mask) == (sub->id & sub->mask)) {
+            p += lws_snprintf(p, lws_ptr_diff_size_t(end, p), "%s{\"id\":%u,\"fd\":%d,",
+                              first ? "" : ",", (unsigned int)rec->frame.can_id, rec->fd);
+            if (sub->flags & SYKO_CANMON_F_TS)
+                p += lws_snprintf(p, lws_ptr_diff_size_t(end, p), "\"ts\":%llu,\"ts_src\":\"%s\",",
+                                  (unsigned long long)rec->ts,
+                                  sykoCanTsName((enum syko_can_ts_src)rec->ts_src));
+            p += lws_snprintf(p, lws_ptr_diff_size_t(end, p), "\"data\":\"");
+            for (int i = 0; i < rec->frame.len && i < CANFD_MAX_DLEN; i++) {
+                *p++ = "0123456789ABCDEF"[rec->frame.data[i] >> 4];
+                *p++ = "0123456789ABCDEF"[rec->frame.data[i] & 0xF];
+            }
+            *p++ = '"';
+            *p++ = '}';
+            first = 0;
+        }
+        lws_ring_consume(m->ring, &sub->tail, NULL, 1);
+    }
+
+    p += lws_snprintf(p, lws_ptr_diff_size_t(end, p),
+                      "],\"lost\":%u,\"version\":\"" SYKO_PROTOCOL_VERSION "\","
+                      "\"response\":\"remotegui/can-frames\",\"status\":\"ok\"}", sub->lost);
+    sub->lost = 0;
+
+    sykoCanMonOldest(m);
+
+    return lws_ptr_diff_size_t(p, (char *)buf);
+}
@@ -0,0 +1,44 @@
+#ifndef SYKO_CANMON_H
+#define SYKO_CANMON_H
+
+#include <libwebsockets.h>
+#include "syko_can.h"
+
+/*
+ * CAN monitor: received frames fanned out to subscribed connections. Each
+ * CAN interface's rx path is the single producer into its own lws_ring,
+ * and a subscription follows one interface. Each subscriber has its own
+ * tail and renders its frames straight from the ring into its tx window,
+ * so frame data is never copied per subscriber.
+ *
+ * When the ring fills up, the subscribers holding the oldest tail lose
+ * their backlog (counted in lost) rather than the producer stalling or
+ * the other subscribers losing frames.
+ */
+#define SYKO_CANMON_RING        1024    // Frames
+#define SYKO_CANMON_MSG_MIN     512     // Smallest tx window we render into
+
+#define SYKO_CANMON_F_TS        (1u << 0)   // Include rx timestamps, for datalogs
+
+struct syko_can_sub {
+    lws_dll2_t list;
+    uint32_t tail;
+    enum syko_can_ifs bus;
+    canid_t id, mask;               // CAN_RAW_FILTER semantics
+    unsigned int flags;
+    unsigned int lost;              // Frames dropped since the last message
+    void (*wake)(struct syko_can_sub *sub);
+};
+
+int sykoCanMonInit();
+void sykoCanMonDestroy();
+void sykoCanMonPush(enum syko_can_ifs bus, const struct canfd_frame *frame, int fd,
+                    uint64_t ts, enum syko_can_ts_src src);
+void sykoCanMonWake(enum syko_can_ifs bus);
+int sykoCanMonSubscribe(struct syko_can_sub *sub, enum syko_can_ifs bus,
+                        canid_t id, canid_t mask, unsigned int flags);
+void sykoCanMonUnsubscribe(struct syko_can_sub *sub);
+int sykoCanMonPending(struct syko_can_sub *sub);
+size_t sykoCanMonWrite(struct syko_can_sub *sub, uint8_t *buf, size_t len);
+
+#endif
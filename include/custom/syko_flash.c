@@ -0,0 +1,466 @@
+#include "syko_flash.h"
+#include "syko_fwcache.h"
+#include "syko_handler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum syko_flash_phase {
+    FLASH_SESSION,
+    FLASH_DOWNLOAD,
+    FLASH_TRANSFER,
+    FLASH_EXIT,
+    FLASH_DONE,
+};
+
+static const char * const flash_phase_names[] = {
+    "session", "download", "transfer", "exit", "done"
+};
+
+struct syko_flash {
+    lws_dll2_t list;                // In session->flashes while the stream follows it
+    struct syko_session *session;
+    int sequence;
+    enum syko_ecus ecu;
+    struct syko_fwcache_entry *cached;  // The image's cache entry, or
+    uint8_t *map;                       // our own mapping of a plain file
+    const uint8_t *image;
+    size_t image_len;               // Mapped bytes, compressed ones for gzip
+    struct inflator_ctx *inf;       // gzip images only, from here on
+    const uint8_t *ring;            // Inflator output
+    size_t ring_len, *opl, *cl;
+    uint8_t *bufs;                  // Two blocks, one on the bus and the next
+    uint8_t cur;                    // bufs half the block at acked is in
+    uint8_t fed;                    // The inflator has the mapping as its input
+    uint8_t eos;                    // Inflator reached the end of the stream
+    uint8_t bad;                    // Inflating the next block failed
+    uint32_t address;
+    size_t size;                    // Uncompressed
+    size_t acked;                   // Image bytes the ECU has accepted
+    size_t block;                   // Data bytes per TransferData
+    unsigned int blocks;
+    lws_usec_t start;
+    uint8_t phase;
+    uint8_t bsc;                    // blockSequenceCounter of the next block
+    uint8_t busy;                   // A UDS request is out
+    uint8_t dirty;                  // Progress not yet reported
+    const char *status;
+};
+
+static void sykoFlashFree(struct syko_flash *f){
+    if (f->inf)
+        lws_upng_inflator_destroy(&f->inf);
+    free(f->bufs);
+    if (f->cached)
+        sykoFwCachePut(f->cached);
+    else if (f->map)
+        munmap(f->map, f->image_len);
+    free(f);
+}
+
+static void sykoFlashWake(struct syko_flash *f){
+    f->dirty = 1;
+    if (f->session && f->session->wake)
+        f->session->wake(f->session);
+}
+
+static void sykoFlashResetDone(enum syko_ecus ecu, int err, const uint8_t *rsp, size_t len, void *opaque){
+    if (err) {
+        lwsl_warn("Flash %s: ECUReset failed %d, leaving the session to time out\n",
+                  sykoIsotpEcu(ecu)->name, err);
+        sykoUdsRelease(ecu);
+    }
+}
+
+/* Out of programmingSession, whether or not the flash got anywhere */
+static void sykoFlashReset(enum syko_ecus ecu){
+    static const uint8_t reset_req[] = { SYKO_UDS_ECU_RESET, SYKO_UDS_RESET_HARD };
+    int n = sykoUdsRequest(ecu, reset_req, sizeof(reset_req), sykoFlashResetDone, NULL);
+
+    if (n)
+        sykoFlashResetDone(ecu, n, NULL, 0, NULL);
+}
+
+static void sykoFlashFinish(struct syko_flash *f, const char *status){
+    char payload[128];
+    int n;
+
+    f->phase = FLASH_DONE;
+    f->status = status;
+
+    n = lws_snprintf(payload, sizeof(payload), "{\"ecu\":\"%s\",\"bytes\":%zu,\"blocks\":%u,\"ms\":%llu}",
+                     sykoIsotpEcu(f->ecu)->name, f->acked, f->blocks,
+                     (unsigned long long)((lws_now_usecs() - f->start) / LWS_US_PER_MS));
+
+    lwsl_user("Flash %s: %s, %zu of %zu bytes\n", sykoIsotpEcu(f->ecu)->name, status, f->acked, f->size);
+
+    if (f->session) {
+        lws_dll2_remove(&f->list);
+        if (f->session->complete)
+            f->session->complete(f->session, f->sequence, status, payload, (size_t)n);
+        f->session = NULL;
+    }
+
+    sykoFlashReset(f->ecu);
+    sykoFlashFree(f);
+}
+
+static const char * sykoFlashStatus(int err){
+    return err > 0 ? "negative" : err == -ETIMEDOUT ? "can-timeout" :
+           err == -EBUSY ? "can-busy" : "can-error";
+}
+
+/* Uncompressed size from the trailer of a gzip image, 0 if it isn't one */
+static size_t sykoFlashGzipSize(const uint8_t *image, size_t len){
+    const uint8_t *t = image + len - 4;
+
+    // Header, an empty deflate stream and the trailer at the least
+    if (len < 20 || image[0] != 0x1F || image[1] != 0x8B || image[2] != 8)
+        return 0;
+
+    return (size_t)t[0] | (size_t)t[1] << 8 | (size_t)t[2] << 16 | (size_t)t[3] << 24;
+}
+
+static int sykoFlashInflateStart(struct syko_flash *f){
+    f->inf = lws_upng_inflator_create(&f->ring, &f->ring_len, &f->opl, &f->cl);
+    f->bufs = malloc(2 * SYKO_ISOTP_MAX);
+
+    return f->inf && f->bufs ? 0 : -ENOMEM;
+}
+
+/*
+ * Inflates the next len bytes of the image into dst. The whole mapping is
+ * the inflator's input, so only its 32K output ring and the two blocks are
+ * ever held uncompressed.
+ */
+static int sykoFlashInflate(struct syko_flash *f, uint8_t *dst, size_t len){
+    lws_stateful_ret_t r;
+    size_t have = 0, n, pos, before;
+
+    while (have < len) {
+        if (*f->opl != *f->cl) {
+            pos = *f->cl % f->ring_len;
+            n = *f->opl - *f->cl;
+            if (n > len - have)
+                n = len - have;
+            if (n > f->ring_len - pos)
+                n = f->ring_len - pos;
+
+            memcpy(dst + have, f->ring + pos, n);
+            have += n;
+            *f->cl += n;
+            continue;
+        }
+
+        // Shorter than the trailer said
+        if (f->eos)
+            return -1;
+
+        before = *f->opl;
+        r = lws_upng_inflate_data(f->inf, f->fed ? NULL : f->image, f->image_len);
+        f->fed = 1;
+        if (r & LWS_SRET_FATAL)
+            return -1;
+        if (r == LWS_SRET_OK)
+            f->eos = 1;
+        else if (!(r & LWS_SRET_WANT_OUTPUT) && *f->opl == before)
+            return -1;          // Wants input we don't have
+    }
+
+    return 0;
+}
+
+/* Gets the block at off ready while the one before it is on the bus */
+static void sykoFlashPrefetch(struct syko_flash *f, size_t off){
+    size_t page = (size_t)getpagesize(), start, end;
+
+    if (off >= f->size)
+        return;
+
+    end = off + f->block < f->size ? off + f->block : f->size;
+
+    if (f->inf) {
+        f->bad = !!sykoFlashInflate(f, f->bufs + (f->cur ^ 1) * SYKO_ISOTP_MAX, end - off);
+        return;
+    }
+
+    start = off & ~(page - 1);
+    madvise((void *)(f->image + start), end - start, MADV_WILLNEED);
+}
+
+static void sykoFlashResponse(enum syko_ecus ecu, int err, const uint8_t *rsp, size_t len, void *opaque);
+
+static void sykoFlashRequest(struct syko_flash *f, const uint8_t *req, size_t len){
+    int n = sykoUdsRequest(f->ecu, req, len, sykoFlashResponse, f);
+
+    if (n) {
+        sykoFlashFinish(f, sykoFlashStatus(n));
+        return;
+    }
+
+    f->busy = 1;
+}
+
+/* RequestDownload: uncompressed, 4 byte address and 4 byte size */
+static void sykoFlashDownload(struct syko_flash *f){
+    uint8_t req[11] = { SYKO_UDS_REQUEST_DOWNLOAD, 0x00, 0x44 };
+
+    lws_ser_wu32be(req + 3, f->address);
+    lws_ser_wu32be(req + 7, (uint32_t)f->size);
+
+    f->phase = FLASH_DOWNLOAD;
+    sykoFlashRequest(f, req, sizeof(req));
+}
+
+/* maxNumberOfBlockLength counts the SID and counter too, and must fit in one message */
+static int sykoFlashBlockSize(struct syko_flash *f, const uint8_t *rsp, size_t len){
+    size_t lfi, max = 0;
+
+    if (len < 2)
+        return -1;
+
+    lfi = rsp[1] >> 4;
+    if (!lfi || len < 2 + lfi)
+        return -1;
+
+    for (size_t i = 0; i < lfi; i++)
+        max = (max << 8) | rsp[2 + i];
+
+    if (max > SYKO_ISOTP_MAX)
+        max = SYKO_ISOTP_MAX;
+    if (max < 3)
+        return -1;
+
+    f->block = max - 2;
+
+    return 0;
+}
+
+static size_t sykoFlashBlockLen(const struct syko_flash *f){
+    return f->size - f->acked < f->block ? f->size - f->acked : f->block;
+}
+
+/* TransferData for the next block, straight from the mapping or its inflated buffer */
+static void sykoFlashBlock(struct syko_flash *f){
+    uint8_t hdr[2] = { SYKO_UDS_TRANSFER_DATA, f->bsc };
+    size_t len = sykoFlashBlockLen(f);
+    int n;
+
+    n = sykoUdsRequestRef(f->ecu, hdr, sizeof(hdr),
+                          f->inf ? f->bufs + f->cur * SYKO_ISOTP_MAX : f->image + f->acked,
+                          len, sykoFlashResponse, f);
+    if (n) {
+        sykoFlashFinish(f, sykoFlashStatus(n));
+        return;
+    }
+
+    f->busy = 1;
+    sykoFlashPrefetch(f, f->acked + len);
+}
+
+static void sykoFlashResponse(enum syko_ecus ecu, int err, const uint8_t *rsp, size_t len, void *opaque){
+    static const uint8_t exit_req[] = { SYKO_UDS_TRANSFER_EXIT };
+    struct syko_flash *f = opaque;
+
+    f->busy = 0;
+
+    if (err) {
+        sykoFlashFinish(f, sykoFlashStatus(err));
+        return;
+    }
+
+    switch (f->phase) {
+    case FLASH_SESSION:
+        sykoFlashDownload(f);
+        break;
+
+    case FLASH_DOWNLOAD:
+        if (sykoFlashBlockSize(f, rsp, len)) {
+            sykoFlashFinish(f, "bad-response");
+            break;
+        }
+
+        f->phase = FLASH_TRANSFER;
+        f->bsc = 1;
+        if (f->inf && sykoFlashInflate(f, f->bufs, sykoFlashBlockLen(f))) {
+            sykoFlashFinish(f, "bad-image");
+            break;
+        }
+        sykoFlashBlock(f);
+        break;
+
+    case FLASH_TRANSFER:
+        if (len < 2 || rsp[1] != f->bsc) {
+            sykoFlashFinish(f, "bad-response");
+            break;
+        }
+
+        f->acked += sykoFlashBlockLen(f);
+        f->blocks++;
+        f->bsc++;           // Wraps to 0 after 0xFF
+        f->cur ^= 1;
+        sykoFlashWake(f);
+
+        if (f->acked == f->size) {
+            f->phase = FLASH_EXIT;
+            sykoFlashRequest(f, exit_req, sizeof(exit_req));
+            break;
+        }
+
+        if (f->bad) {
+            sykoFlashFinish(f, "bad-image");
+            break;
+        }
+        sykoFlashBlock(f);
+        break;
+
+    case FLASH_EXIT:
+        sykoFlashFinish(f, "ok");
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Our own read-only mapping of a plain file in SYKO_FLASH_DIR */
+static int sykoFlashMap(struct syko_flash *f, const char *image){
+    struct stat st;
+    char path[256];
+    void *map;
+    int fd;
+
+    lws_snprintf(path, sizeof(path), "%s/%s", SYKO_FLASH_DIR, image);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -ENOENT;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+        close(fd);
+        return -ENOENT;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -ENOENT;
+
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    f->map = map;
+    f->image = map;
+    f->image_len = (size_t)st.st_size;
+
+    return 0;
+}
+
+/*
+ * Returns 0 once the flash is under way, else an error for the reply. The
+ * image is a SHA-256 in the firmware cache if sha256 is given, which must
+ * be 64 hex digits, else a plain file name in SYKO_FLASH_DIR, which may be
+ * linked to the cache.
+ * Either may be gzip compressed.
+ */
+int sykoFlashStart(struct syko_session *session, int sequence, enum syko_ecus ecu,
+                   const char *image, const char *sha256, uint32_t address){
+    static const uint8_t session_req[] = { SYKO_UDS_SESSION_CONTROL, SYKO_FLASH_SESSION };
+    struct syko_flash *f;
+    int n;
+
+    if (sha256 ? !sykoFwCacheHexValid(sha256) : !sykoFwCacheNameValid(image))
+        return -EINVAL;
+
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        return -ENOMEM;
+
+    f->cached = sha256 ? sykoFwCacheGet(sha256) : sykoFwCacheGetName(image);
+    if (f->cached) {
+        f->image = f->cached->map;
+        f->image_len = f->cached->size;
+    } else if (sha256 || sykoFlashMap(f, image)) {
+        sykoFlashFree(f);
+        return -ENOENT;
+    }
+
+    f->size = sykoFlashGzipSize(f->image, f->image_len);
+    if (f->size) {
+        n = sykoFlashInflateStart(f);
+        if (n) {
+            sykoFlashFree(f);
+            return n;
+        }
+    } else
+        f->size = f->image_len;
+
+    if ((uint64_t)f->image_len > 0xFFFFFFFFull) {
+        sykoFlashFree(f);
+        return -ENOENT;
+    }
+
+    f->ecu = ecu;
+    f->address = address;
+    f->start = lws_now_usecs();
+    f->phase = FLASH_SESSION;
+
+    n = sykoUdsRequest(ecu, session_req, sizeof(session_req), sykoFlashResponse, f);
+    if (n) {
+        sykoFlashFree(f);
+        return n;
+    }
+    f->busy = 1;
+
+    f->session = session;
+    f->sequence = sequence;
+    lws_dll2_add_tail(&f->list, &session->flashes);
+
+    lwsl_user("Flash %s: %s%s%s, %zu bytes at 0x%08X\n", sykoIsotpEcu(ecu)->name,
+              sha256 ? sha256 : image, f->cached ? " (cached)" : "", f->inf ? " (gzip)" : "",
+              f->size, (unsigned int)address);
+
+    return 0;
+}
+
+int sykoFlashPending(struct syko_session *session){
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&session->flashes)) {
+        if (lws_container_of(d, struct syko_flash, list)->dirty)
+            return 1;
+    } lws_end_foreach_dll(d);
+
+    return 0;
+}
+
+/* One progress message for the first flash with news, 0 if there is none */
+size_t sykoFlashWrite(struct syko_session *session, uint8_t *buf, size_t len){
+    if (len < SYKO_FLASH_MSG_MIN)
+        return 0;
+
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&session->flashes)) {
+        struct syko_flash *f = lws_container_of(d, struct syko_flash, list);
+
+        if (f->dirty) {
+            f->dirty = 0;
+
+            return (size_t)lws_snprintf((char *)buf, len,
+                        "{\"remotegui/program-progress\":{\"ecu\":\"%s\",\"phase\":\"%s\","
+                        "\"bytes\":%zu,\"total\":%zu},\"version\":\"" SYKO_PROTOCOL_VERSION "\","
+                        "\"sequence\":%d,\"response\":\"remotegui/program-progress\",\"status\":\"ok\"}",
+                        sykoIsotpEcu(f->ecu)->name, flash_phase_names[f->phase],
+                        f->acked, f->size, f->sequence);
+        }
+    } lws_end_foreach_dll(d);
+
+    return 0;
+}
+
+/* The stream is closing, its flashes carry on without reporting */
+void sykoFlashClose(struct syko_session *session){
+    lws_start_foreach_dll_safe(struct lws_dll2 *, d, d1, lws_dll2_get_head(&session->flashes)) {
+        struct syko_flash *f = lws_container_of(d, struct syko_flash, list);
+
+        f->session = NULL;
+        lws_dll2_remove(&f->list);
+    } lws_end_foreach_dll_safe(d, d1);
+}
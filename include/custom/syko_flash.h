@@ -0,0 +1,53 @@
+#ifndef SYKO_FLASH_H
+#define SYKO_FLASH_H
+
+#include <libwebsockets.h>
+#include "syko_uds.h"
+
+struct syko_session;
+
+/*
+ * ECU reprogramming: DiagnosticSessionControl (programming), then
+ * RequestDownload, TransferData blocks and RequestTransferExit, all
+ * through the UDS engine on the lws loop.
+ *
+ * Blocks are as big as the ECU's maxNumberOfBlockLength allows, capped by
+ * what one ISO-TP message can carry. The image is mapped read-only and
+ * each TransferData is sent from the mapping in place; while one block is
+ * on the bus or waiting for its response, the kernel is asked to read
+ * ahead the next one, so it goes out as soon as the previous one is
+ * acknowledged.
+ *
+ * The stream that started a flash gets remotegui/program-progress
+ * messages as blocks are acknowledged, and its program-vehicle reply
+ * once the ECU has accepted RequestTransferExit or the flash has failed.
+ * If the stream closes first, the flash carries on to the end regardless;
+ * abandoning an ECU half-programmed is worse.
+ *
+ * However it ends, the ECU is then sent ECUReset (hardReset) so it leaves
+ * programmingSession and we stop keeping that session alive. If the reset
+ * isn't accepted, the session is released and the ECU times out of it.
+ *
+ * Images are given by SHA-256 from the firmware cache, or by plain file
+ * name in SYKO_FLASH_DIR. A gzip image is inflated as it goes with the lws
+ * inflator, from the mapping into two block buffers that are sent in place
+ * in turn, so it is stored and uploaded compressed and never held whole
+ * uncompressed. RequestDownload announces the size from its trailer.
+ */
+#define SYKO_FLASH_DIR              "images"
+#define SYKO_FLASH_SESSION          0x02    // programmingSession
+#define SYKO_FLASH_MSG_MIN          256     // Smallest tx window we render into
+
+#define SYKO_UDS_REQUEST_DOWNLOAD   0x34
+#define SYKO_UDS_TRANSFER_DATA      0x36
+#define SYKO_UDS_TRANSFER_EXIT      0x37
+
+struct syko_flash;
+
+int sykoFlashStart(struct syko_session *session, int sequence, enum syko_ecus ecu,
+                   const char *image, const char *sha256, uint32_t address);
+size_t sykoFlashWrite(struct syko_session *session, uint8_t *buf, size_t len);
+int sykoFlashPending(struct syko_session *session);
+void sykoFlashClose(struct syko_session *session);
+
+#endif
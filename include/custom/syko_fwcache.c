@@ -0,0 +1,307 @@
+#include "syko_fwcache.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static lws_dll2_owner_t fwcache_list;
+static uint64_t fwcache_bytes;
+
+/* 1 with s in lowercase in hex if s is a SHA-256 in hex */
+static int sykoFwCacheKey(const char *s, char *hex){
+    size_t i;
+
+    for (i = 0; s[i]; i++) {
+        if (i >= SYKO_FWCACHE_HEX || !isxdigit((unsigned char)s[i]))
+            return 0;
+        hex[i] = (char)tolower((unsigned char)s[i]);
+    }
+    hex[i] = '\0';
+
+    return i == SYKO_FWCACHE_HEX;
+}
+
+/* A SHA-256 as the client gives it: exactly 64 hex digits, either case */
+int sykoFwCacheHexValid(const char *sha256){
+    char hex[SYKO_FWCACHE_HEX + 1];
+
+    return sha256 && sykoFwCacheKey(sha256, hex);
+}
+
+/*
+ * Image names in SYKO_FLASH_DIR, for upload and flash alike. They become
+ * file names and go back to the client unescaped in JSON, so only
+ * [A-Za-z0-9._-], not starting with '.', and short enough for an
+ * upload's ".part" to fit after them.
+ */
+int sykoFwCacheNameValid(const char *name){
+    size_t i;
+
+    if (!name || !*name || *name == '.')
+        return 0;
+
+    for (i = 0; name[i]; i++)
+        if (!isalnum((unsigned char)name[i]) && name[i] != '.' && name[i] != '_' && name[i] != '-')
+            return 0;
+
+    return i < SYKO_FWCACHE_NAME_MAX - 5;
+}
+
+static void sykoFwCachePath(char *path, size_t len, const char *hex){
+    lws_snprintf(path, len, "%s/%s", SYKO_FWCACHE_DIR, hex);
+}
+
+static struct syko_fwcache_entry * sykoFwCacheFind(const char *hex){
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&fwcache_list)) {
+        struct syko_fwcache_entry *e = lws_container_of(d, struct syko_fwcache_entry, list);
+
+        if (!strcmp(e->hex, hex))
+            return e;
+    } lws_end_foreach_dll(d);
+
+    return NULL;
+}
+
+static int sykoFwCacheNewer(const lws_dll2_t *d, const lws_dll2_t *i){
+    const struct syko_fwcache_entry *a = lws_container_of(d, struct syko_fwcache_entry, list);
+    const struct syko_fwcache_entry *b = lws_container_of(i, struct syko_fwcache_entry, list);
+
+    // Ahead of ties, so an entry added now is the most recent
+    return a->used >= b->used ? -1 : 1;
+}
+
+static struct syko_fwcache_entry * sykoFwCacheInsert(const char *hex, size_t size, time_t used){
+    struct syko_fwcache_entry *e = calloc(1, sizeof(*e));
+
+    if (!e)
+        return NULL;
+
+    lws_strncpy(e->hex, hex, sizeof(e->hex));
+    e->size = size;
+    e->used = used;
+    lws_dll2_add_sorted(&e->list, &fwcache_list, sykoFwCacheNewer);
+    fwcache_bytes += size;
+
+    return e;
+}
+
+static void sykoFwCacheFree(struct syko_fwcache_entry *e){
+    lws_dll2_remove(&e->list);
+    fwcache_bytes -= e->size;
+    if (e->map)
+        munmap((void *)e->map, e->size);
+    free(e);
+}
+
+/* Most recently used, on disk too so the order survives a restart */
+static void sykoFwCacheTouch(struct syko_fwcache_entry *e){
+    char path[256];
+
+    sykoFwCachePath(path, sizeof(path), e->hex);
+    utimensat(AT_FDCWD, path, NULL, 0);
+    e->used = time(NULL);
+
+    lws_dll2_remove(&e->list);
+    lws_dll2_add_head(&e->list, &fwcache_list);
+}
+
+/*
+ * Deletes least recently used entries nobody holds until we are within
+ * budget. The most recent one stays even if it is over on its own.
+ */
+static void sykoFwCacheTrim(void){
+    struct lws_dll2 *d = lws_dll2_get_tail(&fwcache_list), *prev;
+    char path[256];
+
+    while (d && d != lws_dll2_get_head(&fwcache_list) && fwcache_bytes > SYKO_FWCACHE_BUDGET) {
+        struct syko_fwcache_entry *e = lws_container_of(d, struct syko_fwcache_entry, list);
+
+        prev = d->prev;
+        if (!e->refs) {
+            lwsl_user("Firmware cache: evicting %s, %zu bytes\n", e->hex, e->size);
+            sykoFwCachePath(path, sizeof(path), e->hex);
+            unlink(path);
+            sykoFwCacheFree(e);
+        }
+        d = prev;
+    }
+}
+
+int sykoFwCacheHas(const char *sha256, size_t size){
+    struct syko_fwcache_entry *e;
+    char hex[SYKO_FWCACHE_HEX + 1];
+
+    if (!sykoFwCacheKey(sha256, hex))
+        return 0;
+
+    e = sykoFwCacheFind(hex);
+
+    return e && e->size == size;
+}
+
+/*
+ * Moves the file at path into the cache as hex, which the caller has
+ * checked is its SHA-256. If the image is already cached the file is
+ * just removed.
+ */
+int sykoFwCacheAdd(const char *sha256, const char *path){
+    struct syko_fwcache_entry *e;
+    char hex[SYKO_FWCACHE_HEX + 1], dest[256];
+    struct stat st;
+
+    if (!sykoFwCacheKey(sha256, hex) || stat(path, &st) || !S_ISREG(st.st_mode))
+        return -EINVAL;
+
+    e = sykoFwCacheFind(hex);
+    if (e) {
+        unlink(path);
+        sykoFwCacheTouch(e);
+        return 0;
+    }
+
+    sykoFwCachePath(dest, sizeof(dest), hex);
+    if (rename(path, dest))
+        return -errno;
+
+    if (!sykoFwCacheInsert(hex, (size_t)st.st_size, time(NULL))) {
+        unlink(dest);
+        return -ENOMEM;
+    }
+
+    sykoFwCacheTrim();
+
+    return 0;
+}
+
+/* Points the image name in SYKO_FLASH_DIR at a cached image */
+int sykoFwCacheLink(const char *sha256, const char *name){
+    char hex[SYKO_FWCACHE_HEX + 1], path[256], target[128];
+
+    if (!sykoFwCacheKey(sha256, hex) || !sykoFwCacheFind(hex))
+        return -ENOENT;
+
+    lws_snprintf(path, sizeof(path), "%s/%s", SYKO_FLASH_DIR, name);
+    lws_snprintf(target, sizeof(target), "cache/%s", hex);
+
+    if ((unlink(path) && errno != ENOENT) || symlink(target, path))
+        return -errno;
+
+    return 0;
+}
+
+/* Referenced and mapped, the map is made on first use */
+static struct syko_fwcache_entry * sykoFwCacheRef(const char *hex){
+    struct syko_fwcache_entry *e;
+    char path[256];
+    void *map;
+    int fd;
+
+    e = sykoFwCacheFind(hex);
+    if (!e)
+        return NULL;
+
+    if (!e->map) {
+        sykoFwCachePath(path, sizeof(path), e->hex);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return NULL;
+
+        map = mmap(NULL, e->size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            lwsl_err("%s: %s: %d\n", __func__, path, errno);
+            return NULL;
+        }
+
+        madvise(map, e->size, MADV_SEQUENTIAL);
+        e->map = map;
+    }
+
+    e->refs++;
+    sykoFwCacheTouch(e);
+
+    return e;
+}
+
+/* A referenced, mapped entry for an image by its SHA-256. NULL if it isn't cached */
+struct syko_fwcache_entry * sykoFwCacheGet(const char *sha256){
+    char hex[SYKO_FWCACHE_HEX + 1];
+
+    if (!sha256 || !sykoFwCacheKey(sha256, hex))
+        return NULL;
+
+    return sykoFwCacheRef(hex);
+}
+
+/*
+ * The same for an image name in SYKO_FLASH_DIR linked to the cache. The
+ * name is checked here, it is never taken for a SHA-256 nor followed
+ * anywhere but into the cache.
+ */
+struct syko_fwcache_entry * sykoFwCacheGetName(const char *name){
+    char hex[SYKO_FWCACHE_HEX + 1], path[256], target[128];
+    ssize_t n;
+
+    if (!sykoFwCacheNameValid(name))
+        return NULL;
+
+    lws_snprintf(path, sizeof(path), "%s/%s", SYKO_FLASH_DIR, name);
+    n = readlink(path, target, sizeof(target) - 1);
+    if (n <= 6 || strncmp(target, "cache/", 6))
+        return NULL;
+    target[n] = '\0';
+    if (!sykoFwCacheKey(target + 6, hex))
+        return NULL;
+
+    return sykoFwCacheRef(hex);
+}
+
+void sykoFwCachePut(struct syko_fwcache_entry *e){
+    if (--e->refs)
+        return;
+
+    munmap((void *)e->map, e->size);
+    e->map = NULL;
+    sykoFwCacheTrim();
+}
+
+static int sykoFwCacheScan(const char *dirpath, void *user, struct lws_dir_entry *lde){
+    char hex[SYKO_FWCACHE_HEX + 1], path[256];
+    struct stat st;
+
+    // Only names we would have written ourselves
+    if ((lde->type != LDOT_FILE && lde->type != LDOT_UNKNOWN) ||
+        !sykoFwCacheKey(lde->name, hex) || strcmp(hex, lde->name))
+        return 0;
+
+    lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+    if (stat(path, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+        return 0;
+
+    return !sykoFwCacheInsert(lde->name, (size_t)st.st_size, st.st_mtime);
+}
+
+int sykoFwCacheInit(){
+    if ((mkdir(SYKO_FLASH_DIR, 0755) && errno != EEXIST) ||
+        (mkdir(SYKO_FWCACHE_DIR, 0755) && errno != EEXIST)) {
+        lwsl_err("%s: %s: %d\n", __func__, SYKO_FWCACHE_DIR, errno);
+        return 1;
+    }
+
+    lws_dir(SYKO_FWCACHE_DIR, NULL, sykoFwCacheScan);
+    sykoFwCacheTrim();
+
+    lwsl_user("Firmware cache: %u images, %llu bytes\n", fwcache_list.count,
+              (unsigned long long)fwcache_bytes);
+
+    return 0;
+}
+
+void sykoFwCacheDestroy(){
+    lws_start_foreach_dll_safe(struct lws_dll2 *, d, d1, lws_dll2_get_head(&fwcache_list)) {
+        sykoFwCacheFree(lws_container_of(d, struct syko_fwcache_entry, list));
+    } lws_end_foreach_dll_safe(d, d1);
+}
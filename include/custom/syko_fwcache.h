@@ -0,0 +1,48 @@
+#ifndef SYKO_FWCACHE_H
+#define SYKO_FWCACHE_H
+
+#include <libwebsockets.h>
+#include "syko_flash.h"
+
+/*
+ * Content addressed firmware cache. Every uploaded image is kept in
+ * SYKO_FWCACHE_DIR under its SHA-256 in lowercase hex, and its name in
+ * SYKO_FLASH_DIR becomes a symlink to it, so an image is stored once
+ * however many names it goes by and never has to be uploaded again while
+ * it is cached. The index is rebuilt from the directory at startup.
+ *
+ * Flashes take a reference on the entry and send straight from a
+ * read-only shared mapping of it, made on first use and dropped with the
+ * last reference.
+ *
+ * The cache is kept under SYKO_FWCACHE_BUDGET by deleting the least
+ * recently used entries nobody holds. Using an entry touches its mtime, so
+ * the order survives restarts. Names left pointing at an evicted image
+ * dangle and flash as no-such-image until it is uploaded again.
+ */
+#define SYKO_FWCACHE_DIR        SYKO_FLASH_DIR "/cache"
+#define SYKO_FWCACHE_BUDGET     (512ull * 1024 * 1024)
+#define SYKO_FWCACHE_HEX        64
+#define SYKO_FWCACHE_NAME_MAX   64      // Image names, with room for ".part" and the NUL
+
+struct syko_fwcache_entry {
+    lws_dll2_t list;                // fwcache_list, most recently used first
+    char hex[SYKO_FWCACHE_HEX + 1];
+    size_t size;
+    time_t used;
+    unsigned int refs;
+    const uint8_t *map;             // While referenced
+};
+
+int sykoFwCacheInit();
+int sykoFwCacheNameValid(const char *name);
+int sykoFwCacheHexValid(const char *sha256);
+void sykoFwCacheDestroy();
+int sykoFwCacheHas(const char *sha256, size_t size);
+int sykoFwCacheAdd(const char *sha256, const char *path);
+int sykoFwCacheLink(const char *sha256, const char *name);
+struct syko_fwcache_entry * sykoFwCacheGet(const char *sha256);
+struct syko_fwcache_entry * sykoFwCacheGetName(const char *name);
+void sykoFwCachePut(struct syko_fwcache_entry *e);
+
+#endif
@@ -1,202 +1,417 @@
 #include "syko_handler.h"
 
-int s;
-struct sockaddr_can addr;
-struct ifreq ifr;
+#include <errno.h>
+
+/*
+ * Perfect hash over the command table. The slot array is sized to a power
+ * of two well above the number of commands and the FNV-1a seed is chosen
+ * once at startup so that every command lands in its own slot. A lookup is
+ * then one hash, one slot read and one memcmp, whatever the table size.
+ */
+#define SYKO_CMD_HASH_SIZE  128
+#define SYKO_CMD_SEED_MAX   4096
+
+/*
+ * Response skeletons, see syko_template.h. The payload template puts the
+ * handler's payload under a member named after the response.
+ */
+#define SYKO_TMPL_TAIL \
+    "\"version\":\"" SYKO_PROTOCOL_VERSION "\",\"sequence\":{{sequence}}," \
+    "\"response\":\"{{response}}\",\"status\":\"{{status}}\"}"
+
+static const char syko_status_tmpl[] = "{" SYKO_TMPL_TAIL;
+static const char syko_payload_tmpl[] = "{\"{{response}}\":{{payload}}," SYKO_TMPL_TAIL;
+
+static const char device_info_payload[] =
+    "{\"button\":[\"EXIT\",\"DONE\"],\"title\":\"DEVICE INFO\",\"type\":\"message\","
+    "\"message\":\"This message contains formatted text of device info.\"}";
+
+static const struct syko_command syko_commands[] = {
+    { "", 0, unknown_command, unknown_command_fnc, syko_status_tmpl, SYKO_CMD_F_CONST },
+#define SYKO_CMD_ENTRY(name, id, fnc, tmpl, flags) { name, sizeof(name) - 1, id, fnc, tmpl, flags },
+    SYKO_COMMANDS(SYKO_CMD_ENTRY)
+#undef SYKO_CMD_ENTRY
+};
+
+static uint8_t syko_cmd_slots[SYKO_CMD_HASH_SIZE];
+static uint32_t syko_cmd_seed;
+
+static uint32_t sykoCommandsHash(uint32_t seed, const char *name, size_t len){
+    uint32_t h = 2166136261u ^ seed;
+
+    while (len--)
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+
+    return h & (SYKO_CMD_HASH_SIZE - 1);
+}
 
-int initCanBus(){
-    s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+int sykoCommandsInit(){
+    uint32_t seed, slot;
+    size_t n;
 
-    if (s < 0){
-        lwsl_user("Socket open error\n");
+    if (LWS_ARRAY_SIZE(syko_commands) * 2 > SYKO_CMD_HASH_SIZE) {
+        lwsl_err("%s: command table too big for hash\n", __func__);
         return 1;
     }
 
-    strcpy(ifr.ifr_name, "can0");
-    ioctl(s, SIOCGIFINDEX, &ifr);
+    for (seed = 0; seed < SYKO_CMD_SEED_MAX; seed++) {
+        memset(syko_cmd_slots, 0, sizeof(syko_cmd_slots));
 
-    addr.can_family = AF_CAN;
-    addr.can_ifindex = ifr.ifr_ifindex;
+        for (n = 1; n < LWS_ARRAY_SIZE(syko_commands); n++) {
+            slot = sykoCommandsHash(seed, syko_commands[n].name, syko_commands[n].len);
+            if (syko_cmd_slots[slot])
+                break;
+            syko_cmd_slots[slot] = (uint8_t)n;
+        }
 
-    // 3. Bindear (enlazar) el socket a la interfaz
-    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        lwsl_user("Binding CAN error\n");
-        close(s);
-        return 1;
+        if (n == LWS_ARRAY_SIZE(syko_commands)) {
+            syko_cmd_seed = seed;
+            lwsl_info("%s: %d commands, seed %u\n", __func__,
+                      (int)LWS_ARRAY_SIZE(syko_commands) - 1, (unsigned int)seed);
+            return 0;
+        }
     }
-    
-    lwsl_user("Succesfuly started CAN\n");
+
+    lwsl_err("%s: no collision-free seed found\n", __func__);
+    return 1;
+}
+
+const struct syko_command * sykoCommandsGet(unsigned int id){
+    return &syko_commands[id < commands_count ? id : unknown_command];
+}
+
+const struct syko_command * sykoCommandsLookup(const char *name, size_t len){
+    const struct syko_command *cmd;
+
+    cmd = &syko_commands[syko_cmd_slots[sykoCommandsHash(syko_cmd_seed, name, len)]];
+    if (cmd->len != len || memcmp(cmd->name, name, len))
+        return &syko_commands[0];
+
+    return cmd;
+}
+
+const struct syko_command * sykoCommandsHandler(const struct syko_request *req){
+    if (req->state != SYKO_REQ_DONE ||
+        !(req->seen & SYKO_REQ_SEEN_SEQUENCE) || !(req->seen & SYKO_REQ_SEEN_REQUEST) ||
+        (req->seen & SYKO_REQ_TRUNCATED)) {
+        lwsl_user("Malformed request\n");
+        return &syko_commands[0];
+    }
+
+    lwsl_user("Sequence: %d, Request: %s\n", req->sequence, req->request);
+
+    return sykoCommandsLookup(req->request, req->request_len);
+}
+
+int unknown_command_fnc(const struct syko_request *req, struct syko_reply *reply){
+    reply->response = "unknown-command";
+    reply->status = "not_found";
+
     return 0;
 }
 
-void sendCanMjs(const char *mjs, size_t len) {
-    size_t bytes_sent = 0, bytes_missing;   
-    struct can_frame frame;
-    int nbytes;
-    
-    frame.can_id = 0x123; 
-    frame.can_dlc = 8;
-    
-    while (bytes_sent < len) {        
-        bytes_missing = len - bytes_sent; 
-        frame.can_dlc = (uint8_t)(bytes_missing > 8 ? 8 : bytes_missing);
-        
-        // Copy data to frame
-        memcpy(frame.data, mjs + bytes_sent, frame.can_dlc);
-        
-        // Fill missing can bus with 0
-        if (frame.can_dlc < 8) {
-             memset(frame.data + frame.can_dlc, 0, 8 - frame.can_dlc);
-        }
+int remotegui_device_info_fnc(const struct syko_request *req, struct syko_reply *reply){ 
+    reply->payload = device_info_payload;
+    reply->payload_len = sizeof(device_info_payload) - 1;
 
-        // Send frame
-        nbytes = write(s, &frame, sizeof(frame));
+    return 0;
+}
 
-        if (nbytes != sizeof(frame)) {
-            lwsl_user("CAN send frame error: only %d bytes were sent\n", nbytes);           
-            return; 
-        }
-        
-        // Update byte counter
-        bytes_sent += frame.can_dlc;
+/*
+ * "sha256" picks a cached image, else "image" is a file in SYKO_FLASH_DIR.
+ * "ecu" defaults to the first one and "address" (C number syntax) to 0. The reply comes when the flash ends,
+ * remotegui/program-progress messages follow it until then.
+ */
+int remotegui_program_vehicle_fnc(const struct syko_request *req, struct syko_reply *reply){
+    const char *ecu_param = sykoRequestParam(req, "ecu");
+    const char *address_param = sykoRequestParam(req, "address");
+    int ecu = ecu_param ? sykoIsotpLookup(ecu_param) : 0;
+    int n;
+
+    if (ecu < 0) {
+        reply->status = "no-such-ecu";
+        return 0;
     }
-    
-    lwsl_user("Message with %zu bytes succesfuly sent by CAN\n", len);
+
+    n = sykoFlashStart(req->session, req->sequence, (enum syko_ecus)ecu, sykoRequestParam(req, "image"),
+                       sykoRequestParam(req, "sha256"),
+                       address_param ? (uint32_t)strtoul(address_param, NULL, 0) : 0);
+    if (!n)
+        return SYKO_REPLY_PENDING;
+
+    reply->status = n == -EINVAL || n == -ENOENT ? "no-such-image" : n == -EBUSY ? "can-busy" : "error";
+
+    return 0;
 }
 
-void receiveCanMjs(){
-    struct can_frame rx_frame;
-    int nbytes;
+/*
+ * A DTC read or clear on one ECU, or on all of them at once. The reply
+ * goes out when the last ECU has answered, with one member per ECU. If
+ * the stream closes first the scan is orphaned and finishes quietly.
+ */
+#define SYKO_DIAG_BUF   256
+
+struct syko_diag {
+    lws_dll2_t list;                // In session->diag while the stream waits
+    struct syko_session *session;
+    int sequence;
+    unsigned int pending;           // ECUs that haven't answered yet
+    uint8_t oom;
+    char *buf;                      // JSON object, grows as ECUs answer
+    size_t len, size;
+};
+
+static void sykoDiagAppend(struct syko_diag *d, const char *fmt, ...){
+    va_list ap;
+    size_t size;
+    char *p;
+    int n;
+
+    if (d->oom)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(d->buf + d->len, d->size - d->len, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && (size_t)n < d->size - d->len) {
+        d->len += (size_t)n;
+        return;
+    }
 
-    // Get frame
-    nbytes = read(s, &rx_frame, sizeof(rx_frame));
+    size = d->size * 2 + (size_t)n;
+    p = n < 0 ? NULL : realloc(d->buf, size);
+    if (!p) {
+        d->oom = 1;
+        return;
+    }
+    d->buf = p;
+    d->size = size;
 
-    if (nbytes < 0) {
-        lwsl_user("Read Can Bus Error");
-    } else if (nbytes == sizeof(rx_frame)) {
-        lwsl_user("Recibido ID: 0x%X, DLC: %d, Data: ", rx_frame.can_id, rx_frame.can_dlc);
-        
-        for (int i = 0; i < rx_frame.can_dlc; i++) {
-            lwsl_user("%02X ", rx_frame.data[i]);
-        }
-        
-        lwsl_user("\n");
-    }
-}
-
-enum commands sykoCommandsTranslate(char * command_request){
-    // Get commands
-     if (strcmp("get/basic-config", command_request) == 0){
-        return get_basic_config;
-     }
-     else if (strcmp("get/full-config", command_request) == 0){
-        return get_full_config;
-     }
-     else if (strcmp("get/available-features", command_request) == 0){
-        return get_available_features;
-     }
-     // Remotegui commands
-     else if (strcmp("remotegui/device-info", command_request) == 0){
-        return remotegui_device_info;
-     }
-     else if (strcmp("remotegui/vehicle-info", command_request) == 0){
-        return remotegui_vehicle_info;
-     }
-     else if (strcmp("remotegui/read-dtc", command_request) == 0){
-        return remotegui_read_dtc;
-     }
-     else if (strcmp("remotegui/clear-dtc", command_request) == 0){
-        return remotegui_clear_dtc;
-     }
-     else if (strcmp("remotegui/program-vehicle", command_request) == 0){
-        return remotegui_program_vehicle;
-     }
-     else if (strcmp("remotegui/datalog", command_request) == 0){
-        return remotegui_datalog;
-     }
-     else if (strcmp("remotegui/user-input", command_request) == 0){
-        return remotegui_user_input;
-     }
-     else{
-        return unknown_command;
-     }
-}
-
-enum commands sykoCommandsHandler(cJSON *root){
-    cJSON *comando = cJSON_GetObjectItemCaseSensitive(root, "sequence");
-    cJSON *request = cJSON_GetObjectItemCaseSensitive(root, "request");
-
-    lwsl_user("Sequence: %d, Request: %s\n", comando->valueint, request->valuestring);
-
-    return sykoCommandsTranslate(request->valuestring);
-
-    // switch ()
-    // {
-    // case get_basic_config:
-    //     /* code */
-    //     break;
-    
-    // default:
-    //     break;
-    // }
-
-    // if (strcmp("remotegui/device-info", request->valuestring) == 0){
-    //     lwsl_user("El buen comando\n");
-    //     sendCanMjs("Hello world!", 12);
-    // }
-}
-
-cJSON * unknown_command_fnc(){
-    cJSON *root = NULL;
+    va_start(ap, fmt);
+    vsnprintf(d->buf + d->len, d->size - d->len, fmt, ap);
+    va_end(ap);
+    d->len += (size_t)n;
+}
 
-    root = cJSON_CreateObject();
+/* One ECU's member: its outcome, and for a read the DTCs with their status */
+static void sykoDiagResult(struct syko_diag *d, enum syko_ecus ecu, int err,
+                           const uint8_t *rsp, size_t len){
+    const char *status = !err ? "ok" : err > 0 ? "negative" :
+                         err == -ETIMEDOUT ? "timeout" : err == -EBUSY ? "busy" : "error";
+
+    sykoDiagAppend(d, "%s\"%s\":{\"status\":\"%s\"", d->len > 1 ? "," : "",
+                   sykoIsotpEcu(ecu)->name, status);
+    if (err > 0)
+        sykoDiagAppend(d, ",\"nrc\":%d", err);
+
+    // 59 02 availability, then DTC high, middle, low and status per record
+    if (!err && len >= 3 && rsp[0] == (SYKO_UDS_READ_DTC | 0x40)) {
+        sykoDiagAppend(d, ",\"dtcs\":[");
+        for (size_t i = 3; i + 4 <= len; i += 4)
+            sykoDiagAppend(d, "%s{\"dtc\":\"%02X%02X%02X\",\"status\":%u}", i > 3 ? "," : "",
+                           rsp[i], rsp[i + 1], rsp[i + 2], rsp[i + 3]);
+        sykoDiagAppend(d, "]");
+    }
+
+    sykoDiagAppend(d, "}");
+}
+
+static void sykoDiagDone(enum syko_ecus ecu, int err, const uint8_t *rsp, size_t len, void *opaque){
+    struct syko_diag *d = opaque;
+
+    sykoDiagResult(d, ecu, err, rsp, len);
+    if (--d->pending)
+        return;
+
+    sykoDiagAppend(d, "}");
+    if (d->session) {
+        lws_dll2_remove(&d->list);
+        if (d->session->complete)
+            d->session->complete(d->session, d->sequence, d->oom ? "error" : "ok",
+                                 d->oom ? NULL : d->buf, d->len);
+    }
+
+    free(d->buf);
+    free(d);
+}
+
+/* "ecu" picks one ECU by name, without it every ECU is asked */
+static int sykoDiagStart(const struct syko_request *req, struct syko_reply *reply,
+                         const uint8_t *uds, size_t len){
+    const char *ecu_param = sykoRequestParam(req, "ecu");
+    int ecu = ecu_param ? sykoIsotpLookup(ecu_param) : 0;
+    int last = ecu_param ? ecu + 1 : syko_ecus_count, n;
+    struct syko_diag *d;
+
+    if (ecu < 0) {
+        reply->status = "no-such-ecu";
+        return 0;
+    }
+
+    d = calloc(1, sizeof(*d));
+    if (d)
+        d->buf = malloc(SYKO_DIAG_BUF);
+    if (!d || !d->buf) {
+        free(d);
+        reply->status = "error";
+        return 0;
+    }
+    d->size = SYKO_DIAG_BUF;
+    d->buf[d->len++] = '{';
+
+    for (; ecu < last; ecu++) {
+        n = sykoUdsRequest((enum syko_ecus)ecu, uds, len, sykoDiagDone, d);
+        if (n)
+            sykoDiagResult(d, (enum syko_ecus)ecu, n, NULL, 0);
+        else
+            d->pending++;
+    }
+
+    if (!d->pending) {
+        free(d->buf);
+        free(d);
+        reply->status = "can-busy";
+        return 0;
+    }
 
-    cJSON_AddStringToObject(root, "version", "1.2.3");
-    cJSON_AddNumberToObject(root, "sequence", 100);
-    cJSON_AddStringToObject(root, "response", "unknown-command");
-    cJSON_AddStringToObject(root, "status", "not_found");
+    d->session = req->session;
+    d->sequence = req->sequence;
+    lws_dll2_add_tail(&d->list, &req->session->diag);
 
-    return root;
+    return SYKO_REPLY_PENDING;
 }
 
-cJSON * remotegui_device_info_fnc(){ 
-    cJSON * root = NULL;
-    cJSON *device_info_obj = NULL;
-    cJSON *button_array = NULL;
+/* "mask" is the DTC status mask, C number syntax, every DTC by default */
+int remotegui_read_dtc_fnc(const struct syko_request *req, struct syko_reply *reply){
+    const char *mask_param = sykoRequestParam(req, "mask");
+    uint8_t uds[3] = { SYKO_UDS_READ_DTC, SYKO_UDS_DTC_BY_STATUS, 0xFF };
 
-    root = cJSON_CreateObject();
-    device_info_obj = cJSON_CreateObject();
-    button_array = cJSON_CreateArray();
+    if (mask_param)
+        uds[2] = (uint8_t)strtoul(mask_param, NULL, 0);
 
-    cJSON_AddItemToArray(button_array, cJSON_CreateString("EXIT"));
-    cJSON_AddItemToArray(button_array, cJSON_CreateString("DONE"));
+    return sykoDiagStart(req, reply, uds, sizeof(uds));
+}
 
-    cJSON_AddItemToObject(device_info_obj, "button", button_array);
-    cJSON_AddStringToObject(device_info_obj, "title", "DEVICE INFO");
-    cJSON_AddStringToObject(device_info_obj, "type", "message");
-    cJSON_AddStringToObject(device_info_obj, "message", "This message contains formatted text of device info.");  
-    
-    cJSON_AddItemToObject(root, "remotegui/device-info", device_info_obj);
-    cJSON_AddStringToObject(root, "version", "1.2.3");
-    cJSON_AddNumberToObject(root, "sequence", 100);
-    cJSON_AddStringToObject(root, "response", "remotegui/device-info");
-    cJSON_AddStringToObject(root, "status", "ok");
+/* Clears every DTC group */
+int remotegui_clear_dtc_fnc(const struct syko_request *req, struct syko_reply *reply){
+    static const uint8_t uds[4] = { SYKO_UDS_CLEAR_DTC, 0xFF, 0xFF, 0xFF };
 
-    return root;
+    return sykoDiagStart(req, reply, uds, sizeof(uds));
 }
 
-cJSON * remotegui_program_vehicle_fnc(){
-    cJSON * root = NULL;
+/* The stream is closing: nothing may call back into its session any more */
+void sykoCommandsClose(struct syko_session *session){
+    sykoFlashClose(session);
+    sykoUploadClose(session);
+
+    lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, lws_dll2_get_head(&session->diag)) {
+        struct syko_diag *d = lws_container_of(p, struct syko_diag, list);
+
+        d->session = NULL;
+        lws_dll2_remove(&d->list);
+    } lws_end_foreach_dll_safe(p, p1);
+}
+
+/*
+ * "image" and "size" are required, "sha256" (hex) is checked if given. The
+ * reply's "offset" is where to start sending, see syko_upload.h; with
+ * "cached" set the image is already here and nothing is sent.
+ */
+int remotegui_upload_image_fnc(const struct syko_request *req, struct syko_reply *reply){
+    const char *size_param = sykoRequestParam(req, "size");
+    size_t offset, size = size_param ? (size_t)strtoull(size_param, NULL, 0) : 0;
+    cJSON *root;
+    int n;
+
+    n = sykoUploadStart(req->session, req->sequence, sykoRequestParam(req, "image"), size,
+                        sykoRequestParam(req, "sha256"), &offset);
+    if (n == SYKO_REPLY_PENDING)
+        return n;
+    if (n) {
+        reply->status = n == -EINVAL ? "bad-request" : n == -EBUSY ? "busy" : "no-space";
+        return 0;
+    }
 
     root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "version", "1.2.3");
-    cJSON_AddNumberToObject(root, "sequence", 120);
-    cJSON_AddStringToObject(root, "response", "remotegui/program-vehicle");
-    cJSON_AddStringToObject(root, "status", "ok");
+    cJSON_AddNumberToObject(root, "offset", (double)offset);
+    if (offset == size)
+        cJSON_AddTrueToObject(root, "cached");
+    reply->payload_json = root;
+
+    return 0;
+}
+
+/* Per bus counters and tx queue depth */
+int remotegui_can_stats_fnc(const struct syko_request *req, struct syko_reply *reply){
+    cJSON *root = cJSON_CreateObject(), *bus;
+
+    for (int i = 0; i < syko_can_ifs_count; i++) {
+        const struct syko_can_stats *st = sykoCanStats((enum syko_can_ifs)i);
+
+        bus = cJSON_AddObjectToObject(root, sykoCanName((enum syko_can_ifs)i));
+        cJSON_AddBoolToObject(bus, "up", sykoCanUp((enum syko_can_ifs)i));
+        cJSON_AddBoolToObject(bus, "fd", sykoCanFd((enum syko_can_ifs)i));
+        cJSON_AddNumberToObject(bus, "rx_frames", (double)st->rx_frames);
+        cJSON_AddNumberToObject(bus, "tx_frames", (double)st->tx_frames);
+        cJSON_AddNumberToObject(bus, "txq_depth", sykoCanTxDepth((enum syko_can_ifs)i));
+        cJSON_AddNumberToObject(bus, "txq_peak", (double)st->txq_peak);
+        cJSON_AddNumberToObject(bus, "tx_full", (double)st->tx_full);
+        cJSON_AddNumberToObject(bus, "tx_nobufs", (double)st->tx_nobufs);
+        cJSON_AddNumberToObject(bus, "tx_dropped", (double)st->tx_dropped);
+        cJSON_AddNumberToObject(bus, "rx_errors", (double)st->rx_errors);
+        cJSON_AddNumberToObject(bus, "tx_errors", (double)st->tx_errors);
+    }
 
-    sendCanMjs("program_ecu", 11);
+    reply->payload_json = root;
 
-    return root;
+    return 0;
 }
 
+/*
+ * Frames then arrive as unsolicited remotegui/can-frames messages. "bus"
+ * names the interface and defaults to the first one. "id" and "mask" are
+ * optional and take C number syntax: no id means every frame, an id
+ * without a mask means just that id.
+ */
+static int sykoCanSubscribeParams(const struct syko_request *req, struct syko_reply *reply,
+                                  unsigned int flags){
+    const char *bus_param = sykoRequestParam(req, "bus");
+    const char *id_param = sykoRequestParam(req, "id");
+    const char *mask_param = sykoRequestParam(req, "mask");
+    canid_t id = id_param ? (canid_t)strtoul(id_param, NULL, 0) : 0;
+    canid_t mask = id_param ? SYKO_CAN_MASK_EXACT(id) : 0;
+    int bus = bus_param ? sykoCanLookup(bus_param) : 0;
+
+    if (bus < 0 || !sykoCanUp((enum syko_can_ifs)bus)) {
+        reply->status = "no-such-bus";
+        return 0;
+    }
+
+    if (mask_param)
+        mask = (canid_t)strtoul(mask_param, NULL, 0);
+
+    if (sykoCanMonSubscribe(&req->session->can_sub, (enum syko_can_ifs)bus, id, mask, flags))
+        reply->status = "can-busy";
+
+    return 0;
+}
 
+int remotegui_can_subscribe_fnc(const struct syko_request *req, struct syko_reply *reply){
+    return sykoCanSubscribeParams(req, reply, 0);
+}
+
+int remotegui_can_unsubscribe_fnc(const struct syko_request *req, struct syko_reply *reply){
+    sykoCanMonUnsubscribe(&req->session->can_sub);
+
+    return 0;
+}
+
+/* A subscription whose frames carry their rx timestamps; "stop" ends it */
+int remotegui_datalog_fnc(const struct syko_request *req, struct syko_reply *reply){
+    if (sykoRequestParam(req, "stop")) {
+        sykoCanMonUnsubscribe(&req->session->can_sub);
+        return 0;
+    }
+
+    return sykoCanSubscribeParams(req, reply, SYKO_CANMON_F_TS);
+}
@@ -3,32 +3,81 @@
 #include <libwebsockets.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>     // Para close()
-#include <sys/socket.h> // Para socket(), bind(), sendto(), recvfrom()
-#include <sys/ioctl.h>
-#include <net/if.h>     // Para struct ifreq
-#include <linux/can.h>  // Para struct can_frame
-#include <linux/can/raw.h> // Para CAN_RAW
+#include "syko_isotp.h"
+#include "syko_uds.h"
+#include "syko_flash.h"
+#include "syko_upload.h"
+#include "syko_session.h"
+#include "syko_request.h"
+#include "syko_template.h"
+
+#define SYKO_PROTOCOL_VERSION   "1.2.3"
+
+/*
+ * Command flags. SYKO_CMD_F_CONST handlers give the same reply whatever
+ * the request: it is rendered once at startup and the handler isn't
+ * called again, see sykoTemplateConst().
+ */
+#define SYKO_CMD_F_CONST    (1u << 0)   // Reply never changes but for the sequence
+
+/*
+ * Command table. Request string, enum id, handler, response template and
+ * flags are declared once here and expanded into both the enum and the
+ * dispatch table. New commands only need a new line.
+ */
+#define SYKO_COMMANDS(X) \
+    X("get/basic-config",          get_basic_config,          unknown_command_fnc,           syko_status_tmpl,  SYKO_CMD_F_CONST) \
+    X("get/full-config",           get_full_config,           unknown_command_fnc,           syko_status_tmpl,  SYKO_CMD_F_CONST) \
+    X("get/available-features",    get_available_features,    unknown_command_fnc,           syko_status_tmpl,  SYKO_CMD_F_CONST) \
+    X("remotegui/device-info",     remotegui_device_info,     remotegui_device_info_fnc,     syko_payload_tmpl, SYKO_CMD_F_CONST) \
+    X("remotegui/vehicle-info",    remotegui_vehicle_info,    unknown_command_fnc,           syko_status_tmpl,  SYKO_CMD_F_CONST) \
+    X("remotegui/read-dtc",        remotegui_read_dtc,        remotegui_read_dtc_fnc,        syko_payload_tmpl, 0) \
+    X("remotegui/clear-dtc",       remotegui_clear_dtc,       remotegui_clear_dtc_fnc,       syko_payload_tmpl, 0) \
+    X("remotegui/program-vehicle", remotegui_program_vehicle, remotegui_program_vehicle_fnc, syko_status_tmpl,  0) \
+    X("remotegui/upload-image",    remotegui_upload_image,    remotegui_upload_image_fnc,    syko_payload_tmpl, 0) \
+    X("remotegui/can-subscribe",   remotegui_can_subscribe,   remotegui_can_subscribe_fnc,   syko_status_tmpl,  0) \
+    X("remotegui/can-unsubscribe", remotegui_can_unsubscribe, remotegui_can_unsubscribe_fnc, syko_status_tmpl,  0) \
+    X("remotegui/datalog",         remotegui_datalog,         remotegui_datalog_fnc,         syko_status_tmpl,  0) \
+    X("remotegui/can-stats",       remotegui_can_stats,       remotegui_can_stats_fnc,       syko_payload_tmpl, 0) \
+    X("remotegui/user-input",      remotegui_user_input,      unknown_command_fnc,           syko_status_tmpl,  SYKO_CMD_F_CONST)
 
 enum commands{
     unknown_command = 0,
-    get_basic_config,
-    get_full_config,
-    get_available_features,
-    remotegui_device_info,
-    remotegui_vehicle_info,
-    remotegui_read_dtc,
-    remotegui_clear_dtc,
-    remotegui_program_vehicle,
-    remotegui_datalog,
-    remotegui_user_input,
+#define SYKO_CMD_ENUM(name, id, fnc, tmpl, flags) id,
+    SYKO_COMMANDS(SYKO_CMD_ENUM)
+#undef SYKO_CMD_ENUM
+    commands_count
+};
+
+/*
+ * Handlers return 0 when the reply is complete, SYKO_REPLY_PENDING when it
+ * will be completed later (see sykoTxFind()), or <0 to drop the connection.
+ */
+#define SYKO_REPLY_PENDING  1
+
+typedef int (*syko_command_fnc)(const struct syko_request *req, struct syko_reply *reply);
+
+struct syko_command {
+    const char *name;
+    size_t len;
+    enum commands id;
+    syko_command_fnc fnc;
+    const char *tmpl;
+    unsigned int flags;
 };
 
-int initCanBus();
-void receiveCanMjs();
-cJSON * unknown_command_fnc();
-cJSON * remotegui_device_info_fnc();
-cJSON * remotegui_program_vehicle_fnc();
-enum commands sykoCommandsHandler(cJSON *root);
-enum commands sykoCommandsTranslate(char * command);
-void sendCanMjs(const char *mjs, size_t len);
+int unknown_command_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_device_info_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_read_dtc_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_clear_dtc_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_program_vehicle_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_upload_image_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_can_subscribe_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_can_unsubscribe_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_datalog_fnc(const struct syko_request *req, struct syko_reply *reply);
+int remotegui_can_stats_fnc(const struct syko_request *req, struct syko_reply *reply);
+int sykoCommandsInit();
+const struct syko_command * sykoCommandsGet(unsigned int id);
+const struct syko_command * sykoCommandsLookup(const char *name, size_t len);
+const struct syko_command * sykoCommandsHandler(const struct syko_request *req);
+void sykoCommandsClose(struct syko_session *session);
@@ -0,0 +1,638 @@
+#include "syko_isotp.h"
+
+#include <errno.h>
+
+// PCI types, high nibble of the first byte
+#define ISOTP_SF    0x00
+#define ISOTP_FF    0x10
+#define ISOTP_CF    0x20
+#define ISOTP_FC    0x30
+
+// Flow status
+#define ISOTP_FS_CTS    0
+#define ISOTP_FS_WAIT   1
+#define ISOTP_FS_OVFLW  2
+
+enum syko_isotp_state {
+    ISOTP_IDLE,
+    ISOTP_WAIT_FC,      // tx: FF or block sent, waiting for the ECU
+    ISOTP_SENDING,      // tx: consecutive frames
+    ISOTP_RECEIVING,    // rx: consecutive frames
+};
+
+struct syko_isotp_tx {
+    lws_sorted_usec_list_t sul;     // STmin pacing or N_Bs
+    syko_isotp_done_cb done;
+    void *opaque;
+    lws_usec_t stmin;
+    size_t len, off;
+    uint8_t state;
+    uint8_t sn;
+    uint8_t bs;
+    uint8_t block_left;
+    uint8_t waits;
+    uint8_t fc_seen;                // The ECU answered this transfer
+    uint8_t blocked;                // CAN queue was full
+    uint8_t fd;                     // This transfer goes out in FD frames
+    uint8_t hdr[SYKO_ISOTP_HDR_MAX];
+    size_t hlen;                    // The message is hdr, then data
+    const uint8_t *data;            // buf, or the caller's for sykoIsotpSendRef()
+    uint8_t buf[SYKO_ISOTP_MAX];
+};
+
+struct syko_isotp_rx {
+    lws_sorted_usec_list_t sul;     // N_Cr
+    syko_isotp_rx_cb cb;
+    syko_isotp_seg_cb seg;          // Same opaque as cb
+    void *opaque;
+    size_t len, off;
+    uint8_t dl;                     // RX_DL, set by the first frame
+    uint8_t fd;                     // The first frame was FD, so is our FC
+    uint8_t state;
+    uint8_t sn;
+    uint8_t bs, stmin;              // What we advertise in our FC
+    uint8_t block_left;
+    uint8_t fc_pending;             // Our CTS found the CAN queue full
+    uint8_t buf[SYKO_ISOTP_MAX];
+};
+
+struct syko_isotp {
+    struct syko_isotp_tx tx;
+    struct syko_isotp_rx rx;
+    unsigned int opens;             // Users of the ECU's kernel rx filter
+    uint8_t fd;                     // Currently talking CAN FD to this ECU
+    uint8_t fd_heard;               // The ECU has sent us FD frames
+};
+
+static const struct syko_ecu syko_ecu_table[] = {
+#define SYKO_ECU_ENTRY(id, name, bus, tx_id, rx_id, flags) { name, bus, tx_id, rx_id, flags },
+    SYKO_ECUS(SYKO_ECU_ENTRY)
+#undef SYKO_ECU_ENTRY
+};
+
+static struct lws_context *isotp_cx;
+static struct syko_isotp isotp_sessions[syko_ecus_count];
+
+static enum syko_ecus sykoIsotpIndex(const struct syko_isotp *s){
+    return (enum syko_ecus)(s - isotp_sessions);
+}
+
+/* Frame data length: classic is always padded to 8, FD to the next valid DLC */
+static uint8_t sykoIsotpFrameLen(int fd, size_t len){
+    static const uint8_t fd_lens[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+    size_t i;
+
+    if (!fd)
+        return CAN_MAX_DLEN;
+
+    for (i = 0; i < LWS_ARRAY_SIZE(fd_lens) - 1 && fd_lens[i] < len; i++)
+        ;
+
+    return fd_lens[i];
+}
+
+static size_t sykoIsotpTxDl(const struct syko_isotp *s){
+    return s->tx.fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+}
+
+/* Consecutive frames are bulk, everything else must not wait behind them */
+static int sykoIsotpFrameAs(struct syko_isotp *s, int fd, const uint8_t *pci, size_t pci_len,
+                            const uint8_t *data, size_t len){
+    const struct syko_ecu *ecu = &syko_ecu_table[sykoIsotpIndex(s)];
+    struct canfd_frame frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = ecu->tx_id;
+    frame.len = sykoIsotpFrameLen(fd, pci_len + len);
+    if (fd && (ecu->flags & SYKO_ECU_F_BRS))
+        frame.flags = CANFD_BRS;
+    memset(frame.data, SYKO_ISOTP_PAD, frame.len);
+    memcpy(frame.data, pci, pci_len);
+    if (len)
+        memcpy(frame.data + pci_len, data, len);
+
+    return sykoCanSend(ecu->bus, &frame, fd,
+                       (pci[0] & 0xF0) == ISOTP_CF ? SYKO_CAN_PRIO_BULK : SYKO_CAN_PRIO_CTRL);
+}
+
+static int sykoIsotpFrame(struct syko_isotp *s, const uint8_t *pci, size_t pci_len,
+                          const uint8_t *data, size_t len){
+    return sykoIsotpFrameAs(s, s->tx.fd, pci, pci_len, data, len);
+}
+
+/* len bytes of the message being sent from off, across the header and data */
+static void sykoIsotpTxGather(const struct syko_isotp_tx *tx, uint8_t *out, size_t off, size_t len){
+    size_t n = 0;
+
+    if (off < tx->hlen) {
+        n = tx->hlen - off < len ? tx->hlen - off : len;
+        memcpy(out, tx->hdr + off, n);
+    }
+    if (len > n)
+        memcpy(out + n, tx->data + off + n - tx->hlen, len - n);
+}
+
+/*
+ * Flow control goes out in the frame type of the first frame it answers,
+ * not in ours: an ECU flagged FD may still send classic frames, and then
+ * it can't read an FD FC.
+ */
+static int sykoIsotpFlowControl(struct syko_isotp *s, int fd, uint8_t fs, uint8_t bs, uint8_t stmin){
+    uint8_t pci[3] = { ISOTP_FC | fs, bs, stmin };
+
+    return sykoIsotpFrameAs(s, fd, pci, sizeof(pci), NULL, 0);
+}
+
+/* Our CTS. If the CAN queue is full it goes out from sykoIsotpTxSpace() */
+static void sykoIsotpRxCts(struct syko_isotp *s){
+    s->rx.fc_pending = !!sykoIsotpFlowControl(s, s->rx.fd, ISOTP_FS_CTS, s->rx.bs, s->rx.stmin);
+}
+
+/* STmin byte to microseconds, reserved values mean the maximum (127 ms) */
+static lws_usec_t sykoIsotpStmin(uint8_t stmin){
+    if (stmin <= 0x7F)
+        return (lws_usec_t)stmin * LWS_US_PER_MS;
+    if (stmin >= 0xF1 && stmin <= 0xF9)
+        return (lws_usec_t)(stmin - 0xF0) * 100;
+
+    return 127 * LWS_US_PER_MS;
+}
+
+static void sykoIsotpTxFinish(struct syko_isotp *s, int err){
+    struct syko_isotp_tx *tx = &s->tx;
+    syko_isotp_done_cb done = tx->done;
+
+    lws_sul_cancel(&tx->sul);
+    tx->state = ISOTP_IDLE;
+    tx->blocked = 0;
+    tx->done = NULL;
+    sykoIsotpClose(sykoIsotpIndex(s));
+
+    if (err)
+        lwsl_warn("%s: %s tx failed %d\n", __func__, syko_ecu_table[sykoIsotpIndex(s)].name, err);
+
+    if (done)
+        done(sykoIsotpIndex(s), err, tx->opaque);
+}
+
+static int sykoIsotpTxFirst(struct syko_isotp *s);
+
+static void sykoIsotpTxTimeout(lws_sorted_usec_list_t *sul){
+    struct syko_isotp *s = lws_container_of(sul, struct syko_isotp, tx.sul);
+
+    // Silence after an FD first frame, the ECU may only speak classic CAN
+    if (s->tx.fd && !s->tx.fc_seen) {
+        lwsl_user("ISO-TP %s: no answer in CAN FD, using classic CAN\n",
+                  syko_ecu_table[sykoIsotpIndex(s)].name);
+        s->fd = 0;
+        if (!sykoIsotpTxFirst(s))
+            return;
+    }
+
+    sykoIsotpTxFinish(s, -ETIMEDOUT);
+}
+
+static void sykoIsotpTxPaced(lws_sorted_usec_list_t *sul);
+
+/* Sends consecutive frames until the block, STmin or the CAN queue stops us */
+static void sykoIsotpTxPump(struct syko_isotp *s){
+    struct syko_isotp_tx *tx = &s->tx;
+    uint8_t pci, data[CANFD_MAX_DLEN];
+    size_t n;
+
+    for (;;) {
+        n = tx->len - tx->off;
+        if (n > sykoIsotpTxDl(s) - 1)
+            n = sykoIsotpTxDl(s) - 1;
+
+        pci = (uint8_t)(ISOTP_CF | tx->sn);
+        sykoIsotpTxGather(tx, data, tx->off, n);
+        if (sykoIsotpFrame(s, &pci, 1, data, n)) {
+            tx->blocked = 1;
+            return;
+        }
+
+        tx->sn = (tx->sn + 1) & 0x0F;
+        tx->off += n;
+
+        if (tx->off == tx->len) {
+            sykoIsotpTxFinish(s, 0);
+            return;
+        }
+
+        if (tx->bs && !--tx->block_left) {
+            tx->state = ISOTP_WAIT_FC;
+            lws_sul_schedule(isotp_cx, 0, &tx->sul, sykoIsotpTxTimeout, SYKO_ISOTP_TIMEOUT_US);
+            return;
+        }
+
+        if (tx->stmin) {
+            lws_sul_schedule(isotp_cx, 0, &tx->sul, sykoIsotpTxPaced, tx->stmin);
+            return;
+        }
+    }
+}
+
+static void sykoIsotpTxPaced(lws_sorted_usec_list_t *sul){
+    struct syko_isotp *s = lws_container_of(sul, struct syko_isotp, tx.sul);
+
+    sykoIsotpTxPump(s);
+}
+
+static void sykoIsotpTxFlowControl(struct syko_isotp *s, const struct canfd_frame *frame){
+    struct syko_isotp_tx *tx = &s->tx;
+
+    if (tx->state != ISOTP_WAIT_FC || frame->len < 3)
+        return;
+
+    tx->fc_seen = 1;
+
+    switch (frame->data[0] & 0x0F) {
+    case ISOTP_FS_CTS:
+        lws_sul_cancel(&tx->sul);
+        tx->bs = frame->data[1];
+        tx->block_left = tx->bs;
+        tx->stmin = sykoIsotpStmin(frame->data[2]);
+        tx->waits = 0;
+        tx->state = ISOTP_SENDING;
+        sykoIsotpTxPump(s);
+        break;
+
+    case ISOTP_FS_WAIT:
+        if (++tx->waits > SYKO_ISOTP_WAIT_MAX) {
+            sykoIsotpTxFinish(s, -EBUSY);
+            break;
+        }
+        lws_sul_schedule(isotp_cx, 0, &tx->sul, sykoIsotpTxTimeout, SYKO_ISOTP_TIMEOUT_US);
+        break;
+
+    case ISOTP_FS_OVFLW:
+        sykoIsotpTxFinish(s, -EMSGSIZE);
+        break;
+
+    default:
+        sykoIsotpTxFinish(s, -EPROTO);
+        break;
+    }
+}
+
+/* First frame of a segmented transfer */
+static int sykoIsotpTxFirst(struct syko_isotp *s){
+    struct syko_isotp_tx *tx = &s->tx;
+    uint8_t pci[2], data[CANFD_MAX_DLEN];
+    size_t n;
+
+    /*
+     * Receivers ignore an FD first frame whose length would fit an FD
+     * single frame, so shorter messages are segmented in classic frames.
+     */
+    tx->fd = s->fd && tx->len > CANFD_MAX_DLEN - 2;
+    n = sykoIsotpTxDl(s) - 2;
+    if (n > tx->len)
+        n = tx->len;
+
+    pci[0] = (uint8_t)(ISOTP_FF | (tx->len >> 8));
+    pci[1] = (uint8_t)tx->len;
+    sykoIsotpTxGather(tx, data, 0, n);
+    if (sykoIsotpFrame(s, pci, 2, data, n))
+        return -ENOBUFS;
+
+    tx->off = n;
+    tx->sn = 1;
+    tx->waits = 0;
+    tx->fc_seen = 0;
+    tx->state = ISOTP_WAIT_FC;
+    lws_sul_schedule(isotp_cx, 0, &tx->sul, sykoIsotpTxTimeout, SYKO_ISOTP_TIMEOUT_US);
+
+    return 0;
+}
+
+static int sykoIsotpTx(enum syko_ecus ecu, const uint8_t *hdr, size_t hlen,
+                       const uint8_t *data, size_t len, int copy,
+                       syko_isotp_done_cb done, void *opaque){
+    struct syko_isotp *s;
+    uint8_t pci[2], frame[CANFD_MAX_DLEN];
+    size_t total = hlen + len;
+    int n, fd;
+
+    if ((unsigned)ecu >= syko_ecus_count || !total || total > SYKO_ISOTP_MAX ||
+        hlen > SYKO_ISOTP_HDR_MAX)
+        return -EINVAL;
+
+    s = &isotp_sessions[ecu];
+    if (s->tx.state != ISOTP_IDLE)
+        return -EBUSY;
+
+    if (hlen)
+        memcpy(s->tx.hdr, hdr, hlen);
+    s->tx.hlen = hlen;
+    s->tx.data = data;
+
+    /*
+     * Single frame, nothing to wait for. FD single frames over 7 bytes use
+     * the escape form. Nothing answers a single frame the ECU can't read,
+     * so there is no fallback for them: they go out as classic CAN until
+     * the ECU has shown it speaks FD. Until then messages of 8 to 62 bytes
+     * are segmented in classic frames, see sykoIsotpTxFirst().
+     */
+    fd = s->fd && s->fd_heard;
+    if (total <= CAN_MAX_DLEN - 1 || (fd && total <= CANFD_MAX_DLEN - 2)) {
+        pci[0] = (uint8_t)(ISOTP_SF | (total <= CAN_MAX_DLEN - 1 ? total : 0));
+        pci[1] = (uint8_t)total;
+        sykoIsotpTxGather(&s->tx, frame, 0, total);
+        if (sykoIsotpFrameAs(s, fd, pci, total <= CAN_MAX_DLEN - 1 ? 1 : 2, frame, total))
+            return -ENOBUFS;
+
+        if (done)
+            done(ecu, 0, opaque);
+        return 0;
+    }
+
+    // Flow control has to reach us for as long as the transfer runs
+    if (sykoIsotpOpen(ecu))
+        return -ENOBUFS;
+
+    if (copy) {
+        memcpy(s->tx.buf, data, len);
+        s->tx.data = s->tx.buf;
+    }
+    s->tx.len = total;
+    n = sykoIsotpTxFirst(s);
+    if (n) {
+        sykoIsotpClose(ecu);
+        return n;
+    }
+
+    s->tx.done = done;
+    s->tx.opaque = opaque;
+
+    return 0;
+}
+
+int sykoIsotpSend(enum syko_ecus ecu, const void *data, size_t len,
+                  syko_isotp_done_cb done, void *opaque){
+    return sykoIsotpTx(ecu, NULL, 0, data, len, 1, done, opaque);
+}
+
+/*
+ * hdr, then data sent in place: data is not copied and must stay valid
+ * until done() is called. For bulk transfers from a mapping.
+ */
+int sykoIsotpSendRef(enum syko_ecus ecu, const void *hdr, size_t hlen,
+                     const void *data, size_t len, syko_isotp_done_cb done, void *opaque){
+    return sykoIsotpTx(ecu, hdr, hlen, data, len, 0, done, opaque);
+}
+
+/* A CAN queue has room again, resume transfers on that bus that found it full */
+void sykoIsotpTxSpace(enum syko_can_ifs bus){
+    for (int i = 0; i < syko_ecus_count; i++) {
+        struct syko_isotp *s = &isotp_sessions[i];
+
+        if (syko_ecu_table[i].bus != bus)
+            continue;
+
+        if (s->rx.fc_pending && s->rx.state == ISOTP_RECEIVING)
+            sykoIsotpRxCts(s);
+
+        if (s->tx.blocked && s->tx.state == ISOTP_SENDING) {
+            s->tx.blocked = 0;
+            sykoIsotpTxPump(s);
+        }
+    }
+}
+
+/* The owner of opaque is going away, its transfers finish without telling it */
+void sykoIsotpDetach(const void *opaque){
+    for (int i = 0; i < syko_ecus_count; i++)
+        if (isotp_sessions[i].tx.done && isotp_sessions[i].tx.opaque == opaque)
+            isotp_sessions[i].tx.done = NULL;
+}
+
+static void sykoIsotpRxAbort(struct syko_isotp *s, const char *why, int err){
+    lwsl_warn("%s: %s rx aborted, %s\n", __func__, syko_ecu_table[sykoIsotpIndex(s)].name, why);
+    lws_sul_cancel(&s->rx.sul);
+    s->rx.state = ISOTP_IDLE;
+    s->rx.fc_pending = 0;
+
+    if (s->rx.seg)
+        s->rx.seg(sykoIsotpIndex(s), NULL, 0, err, s->rx.opaque);
+}
+
+static void sykoIsotpRxTimeout(lws_sorted_usec_list_t *sul){
+    struct syko_isotp *s = lws_container_of(sul, struct syko_isotp, rx.sul);
+
+    if (s->rx.fc_pending)
+        sykoIsotpRxAbort(s, "CAN queue full, FC never sent", -ENOBUFS);
+    else
+        sykoIsotpRxAbort(s, "N_Cr timeout", -ETIMEDOUT);
+}
+
+static void sykoIsotpRxDeliver(struct syko_isotp *s, const uint8_t *buf, size_t len){
+    enum syko_ecus ecu = sykoIsotpIndex(s);
+
+    if (s->rx.cb)
+        s->rx.cb(ecu, buf, len, s->rx.opaque);
+    else
+        lwsl_user("ISO-TP %s: %zu bytes\n", syko_ecu_table[ecu].name, len);
+}
+
+static void sykoIsotpRxFrame(struct syko_isotp *s, const struct canfd_frame *frame, int fd){
+    struct syko_isotp_rx *rx = &s->rx;
+    const uint8_t *d = frame->data;
+    size_t len, off, n;
+
+    switch (d[0] & 0xF0) {
+    case ISOTP_SF:
+        off = 1;
+        len = d[0] & 0x0F;
+        if (!len && frame->len > CAN_MAX_DLEN) {
+            off = 2;
+            len = d[1];
+        }
+        if (!len || len > (size_t)frame->len - off)
+            return;
+        if (rx->state == ISOTP_RECEIVING)
+            sykoIsotpRxAbort(s, "interrupted by SF", -EPROTO);
+        sykoIsotpRxDeliver(s, d + off, len);
+        break;
+
+    case ISOTP_FF:
+        if (frame->len < CAN_MAX_DLEN)
+            return;
+        off = 2;
+        len = ((size_t)(d[0] & 0x0F) << 8) | d[1];
+        if (!len) {
+            // Escape sequence, 32 bit length
+            off = 6;
+            len = ((size_t)d[2] << 24) | ((size_t)d[3] << 16) | ((size_t)d[4] << 8) | d[5];
+        }
+        if (len <= (size_t)frame->len - off)
+            return;
+        if (rx->state == ISOTP_RECEIVING)
+            sykoIsotpRxAbort(s, "interrupted by FF", -EPROTO);
+        if (len > SYKO_ISOTP_MAX) {
+            // Nothing to retry, the sender times out on its own if this is lost
+            if (sykoIsotpFlowControl(s, fd, ISOTP_FS_OVFLW, 0, 0))
+                lwsl_warn("%s: %s overflow FC dropped\n", __func__, syko_ecu_table[sykoIsotpIndex(s)].name);
+            return;
+        }
+
+        n = (size_t)frame->len - off;
+        memcpy(rx->buf, d + off, n);
+        rx->len = len;
+        rx->off = n;
+        rx->dl = frame->len;
+        rx->fd = (uint8_t)fd;
+        rx->sn = 1;
+        rx->block_left = rx->bs;
+        rx->state = ISOTP_RECEIVING;
+        sykoIsotpRxCts(s);
+        lws_sul_schedule(isotp_cx, 0, &rx->sul, sykoIsotpRxTimeout, SYKO_ISOTP_TIMEOUT_US);
+        if (rx->seg)
+            rx->seg(sykoIsotpIndex(s), rx->buf, len, 0, rx->opaque);
+        break;
+
+    case ISOTP_CF:
+        if (rx->state != ISOTP_RECEIVING)
+            return;
+        if ((d[0] & 0x0F) != rx->sn) {
+            sykoIsotpRxAbort(s, "wrong sequence number", -EPROTO);
+            return;
+        }
+
+        n = rx->len - rx->off;
+        if (n > (size_t)rx->dl - 1)
+            n = (size_t)rx->dl - 1;
+        if (n > (size_t)frame->len - 1) {
+            sykoIsotpRxAbort(s, "short CF", -EPROTO);
+            return;
+        }
+
+        memcpy(rx->buf + rx->off, d + 1, n);
+        rx->off += n;
+        rx->sn = (rx->sn + 1) & 0x0F;
+
+        if (rx->off == rx->len) {
+            lws_sul_cancel(&rx->sul);
+            rx->state = ISOTP_IDLE;
+            sykoIsotpRxDeliver(s, rx->buf, rx->len);
+            return;
+        }
+
+        if (rx->bs && !--rx->block_left) {
+            rx->block_left = rx->bs;
+            sykoIsotpRxCts(s);
+        }
+        lws_sul_schedule(isotp_cx, 0, &rx->sul, sykoIsotpRxTimeout, SYKO_ISOTP_TIMEOUT_US);
+        break;
+
+    case ISOTP_FC:
+        sykoIsotpTxFlowControl(s, frame);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Returns 1 if the frame belonged to one of our ECUs */
+int sykoIsotpRx(enum syko_can_ifs bus, const struct canfd_frame *frame, int fd){
+    struct syko_isotp *s;
+
+    for (int i = 0; i < syko_ecus_count; i++) {
+        if (syko_ecu_table[i].bus != bus || !frame->len ||
+            syko_ecu_table[i].rx_id != (frame->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)))
+            continue;
+
+        // The ECU speaks FD, so answer it in FD too
+        s = &isotp_sessions[i];
+        if (fd && (syko_ecu_table[i].flags & SYKO_ECU_F_FD) && sykoCanFd(bus))
+            s->fd = s->fd_heard = 1;
+
+        sykoIsotpRxFrame(s, frame, fd);
+        return 1;
+    }
+
+    return 0;
+}
+
+int sykoIsotpInit(struct lws_context *cx){
+    isotp_cx = cx;
+    memset(isotp_sessions, 0, sizeof(isotp_sessions));
+
+    for (int i = 0; i < syko_ecus_count; i++)
+        isotp_sessions[i].fd = (syko_ecu_table[i].flags & SYKO_ECU_F_FD) &&
+                               sykoCanFd(syko_ecu_table[i].bus);
+
+    return 0;
+}
+
+const struct syko_ecu * sykoIsotpEcu(enum syko_ecus ecu){
+    return &syko_ecu_table[ecu];
+}
+
+/* ECU by its name, -1 if there is no such one */
+int sykoIsotpLookup(const char *name){
+    for (int i = 0; i < syko_ecus_count; i++)
+        if (!strcmp(syko_ecu_table[i].name, name))
+            return i;
+
+    return -1;
+}
+
+/* Block size and STmin we ask ECUs to respect when they send to us */
+void sykoIsotpConfig(enum syko_ecus ecu, uint8_t bs, uint8_t stmin){
+    isotp_sessions[ecu].rx.bs = bs;
+    isotp_sessions[ecu].rx.stmin = stmin;
+}
+
+/*
+ * A registered listener keeps the ECU open. Unregistering also drops its
+ * seg(), before the close can abort a reception and call it.
+ */
+void sykoIsotpOnRx(enum syko_ecus ecu, syko_isotp_rx_cb rx, void *opaque){
+    struct syko_isotp *s = &isotp_sessions[ecu];
+    syko_isotp_rx_cb old = s->rx.cb;
+
+    s->rx.cb = rx;
+    s->rx.opaque = opaque;
+    if (!rx)
+        s->rx.seg = NULL;
+
+    if (rx && !old)
+        sykoIsotpOpen(ecu);
+    else if (!rx && old)
+        sykoIsotpClose(ecu);
+}
+
+void sykoIsotpOnSegment(enum syko_ecus ecu, syko_isotp_seg_cb seg){
+    isotp_sessions[ecu].rx.seg = seg;
+}
+
+/*
+ * Frames from an ECU only reach us while it is open: the first open adds
+ * its rx id to the kernel filter and the last close removes it again.
+ */
+int sykoIsotpOpen(enum syko_ecus ecu){
+    const struct syko_ecu *e = &syko_ecu_table[ecu];
+    struct syko_isotp *s = &isotp_sessions[ecu];
+
+    if (!s->opens && sykoCanFilterAdd(e->bus, e->rx_id, SYKO_CAN_MASK_EXACT(e->rx_id)))
+        return -1;
+
+    s->opens++;
+
+    return 0;
+}
+
+void sykoIsotpClose(enum syko_ecus ecu){
+    const struct syko_ecu *e = &syko_ecu_table[ecu];
+    struct syko_isotp *s = &isotp_sessions[ecu];
+
+    if (!s->opens || --s->opens)
+        return;
+
+    sykoCanFilterRemove(e->bus, e->rx_id, SYKO_CAN_MASK_EXACT(e->rx_id));
+    if (s->rx.state == ISOTP_RECEIVING)
+        sykoIsotpRxAbort(s, "closed", -ECANCELED);
+}
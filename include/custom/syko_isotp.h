@@ -0,0 +1,83 @@
+#ifndef SYKO_ISOTP_H
+#define SYKO_ISOTP_H
+
+#include <libwebsockets.h>
+#include "syko_can.h"
+
+/*
+ * ECUs we talk ISO-TP to: X(id, name, bus, tx_id, rx_id, flags). bus is
+ * the CAN interface the ECU sits on, we send on tx_id and the ECU answers
+ * on rx_id.
+ */
+#define SYKO_ECU_F_FD       (1u << 0)   // Try CAN FD, 64 byte frames
+#define SYKO_ECU_F_BRS      (1u << 1)   // Bit rate switch on FD frames
+
+#define SYKO_ECUS(X) \
+    X(ecu_main, "main", can_powertrain, SYKO_CAN_TX_ID, SYKO_CAN_TX_ID + 1, SYKO_ECU_F_FD | SYKO_ECU_F_BRS)
+
+enum syko_ecus {
+#define SYKO_ECU_ENUM(id, name, bus, tx_id, rx_id, flags) id,
+    SYKO_ECUS(SYKO_ECU_ENUM)
+#undef SYKO_ECU_ENUM
+    syko_ecus_count
+};
+
+/*
+ * ISO 15765-2 over the CAN socket, one session per ECU and one transfer
+ * per direction at a time. Everything runs on the lws service thread:
+ * STmin pacing and the N_Bs / N_Cr timeouts are lws_sul timers, and a
+ * transmit blocked on a full CAN queue resumes from sykoIsotpTxSpace().
+ *
+ * An ECU flagged SYKO_ECU_F_FD is sent FD frames (TX_DL 64) while the
+ * socket allows it. If it never answers the first frame of a transfer in
+ * FD, the session drops to classic CAN and retries once; receiving FD
+ * frames from it switches the session back. Single frames stay classic
+ * until the ECU has sent us FD, since silence tells us nothing there.
+ *
+ * We only hear an ECU while it is open (sykoIsotpOpen(), a registered rx
+ * callback, or a segmented send in progress), see sykoCanFilterAdd().
+ *
+ * done() is called once per sykoIsotpSend() that returned 0, with 0 or a
+ * negative errno, unless sykoIsotpDetach() was called for its opaque
+ * first. rx() is called with each reassembled message; the buffer is only
+ * valid during the call. seg(), set with sykoIsotpOnSegment() for the rx
+ * listener, is told when a segmented message starts arriving, with the
+ * first frame's data as head and the whole length, and again with a
+ * negative errno and no head if that message is then aborted.
+ */
+#define SYKO_ISOTP_MAX          4095    // 12 bit FF_DL
+#define SYKO_ISOTP_PAD          0xCC
+#define SYKO_ISOTP_TIMEOUT_US   (1000 * LWS_US_PER_MS)  // N_Bs and N_Cr
+#define SYKO_ISOTP_WAIT_MAX     10      // FC.WAIT frames we tolerate in a row
+#define SYKO_ISOTP_HDR_MAX      8       // Header bytes sykoIsotpSendRef() puts in front
+
+typedef void (*syko_isotp_done_cb)(enum syko_ecus ecu, int err, void *opaque);
+typedef void (*syko_isotp_rx_cb)(enum syko_ecus ecu, const uint8_t *buf, size_t len, void *opaque);
+typedef void (*syko_isotp_seg_cb)(enum syko_ecus ecu, const uint8_t *head, size_t len, int err,
+                                  void *opaque);
+
+struct syko_ecu {
+    const char *name;
+    enum syko_can_ifs bus;
+    canid_t tx_id;
+    canid_t rx_id;
+    unsigned int flags;
+};
+
+int sykoIsotpInit(struct lws_context *cx);
+const struct syko_ecu * sykoIsotpEcu(enum syko_ecus ecu);
+int sykoIsotpLookup(const char *name);
+void sykoIsotpConfig(enum syko_ecus ecu, uint8_t bs, uint8_t stmin);
+void sykoIsotpOnRx(enum syko_ecus ecu, syko_isotp_rx_cb rx, void *opaque);
+void sykoIsotpOnSegment(enum syko_ecus ecu, syko_isotp_seg_cb seg);
+int sykoIsotpOpen(enum syko_ecus ecu);
+void sykoIsotpClose(enum syko_ecus ecu);
+int sykoIsotpSend(enum syko_ecus ecu, const void *data, size_t len,
+                  syko_isotp_done_cb done, void *opaque);
+int sykoIsotpSendRef(enum syko_ecus ecu, const void *hdr, size_t hlen,
+                     const void *data, size_t len, syko_isotp_done_cb done, void *opaque);
+void sykoIsotpDetach(const void *opaque);
+int sykoIsotpRx(enum syko_can_ifs bus, const struct canfd_frame *frame, int fd);
+void sykoIsotpTxSpace(enum syko_can_ifs bus);
+
+#endif
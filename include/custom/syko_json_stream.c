@@ -0,0 +1,209 @@
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include "syko_json_stream.h"
+
+enum syko_json_stream_phase {
+    SJS_START = 0,      // Emit the member name if the parent is an object
+    SJS_VALUE,          // Emit the value, or open an array/object
+    SJS_STRING,         // Escaping js->str, then js->str_close
+    SJS_RAW,            // Copying js->str verbatim
+    SJS_NEXT,           // Emit ',' and move on, or close the parent
+    SJS_DONE,
+};
+
+static void sykoJsonStreamPut(struct syko_json_stream *js, const char *s, size_t len){
+    memcpy(js->scratch + js->scratch_len, s, len);
+    js->scratch_len = (uint8_t)(js->scratch_len + len);
+}
+
+static void sykoJsonStreamString(struct syko_json_stream *js, const char *str,
+                                 const char *close, uint8_t next){
+    js->str = str ? str : "";
+    js->str_close = close;
+    js->str_next = next;
+    js->phase = SJS_STRING;
+}
+
+static void sykoJsonStreamNumber(struct syko_json_stream *js, const cJSON *item){
+    double d = item->valuedouble, test = 0.0, max;
+    int n;
+
+    // Same rules as cJSON's print_number()
+    if (isnan(d) || isinf(d))
+        n = snprintf(js->scratch, sizeof(js->scratch), "null");
+    else if (d == (double)item->valueint)
+        n = snprintf(js->scratch, sizeof(js->scratch), "%d", item->valueint);
+    else {
+        n = snprintf(js->scratch, sizeof(js->scratch), "%1.15g", d);
+        sscanf(js->scratch, "%lg", &test);
+        max = fabs(test) > fabs(d) ? fabs(test) : fabs(d);
+        if (fabs(test - d) > max * DBL_EPSILON)
+            n = snprintf(js->scratch, sizeof(js->scratch), "%1.17g", d);
+    }
+
+    for (js->scratch_len = 0; js->scratch_len < n; js->scratch_len++)
+        if (js->scratch[js->scratch_len] == ',')
+            js->scratch[js->scratch_len] = '.';
+}
+
+static void sykoJsonStreamStep(struct syko_json_stream *js){
+    const cJSON *item = js->stack[js->depth];
+    unsigned char c;
+
+    js->scratch_len = js->scratch_pos = 0;
+
+    switch (js->phase) {
+    case SJS_START:
+        js->phase = SJS_VALUE;
+        if (js->depth && cJSON_IsObject(js->stack[js->depth - 1])) {
+            sykoJsonStreamPut(js, "\"", 1);
+            sykoJsonStreamString(js, item->string, "\":", SJS_VALUE);
+        }
+        break;
+
+    case SJS_STRING:
+        c = (unsigned char)*js->str;
+        if (!c) {
+            sykoJsonStreamPut(js, js->str_close, strlen(js->str_close));
+            js->phase = js->str_next;
+            break;
+        }
+        js->str++;
+        switch (c) {
+        case '\"': sykoJsonStreamPut(js, "\\\"", 2); break;
+        case '\\': sykoJsonStreamPut(js, "\\\\", 2); break;
+        case '\b': sykoJsonStreamPut(js, "\\b", 2); break;
+        case '\f': sykoJsonStreamPut(js, "\\f", 2); break;
+        case '\n': sykoJsonStreamPut(js, "\\n", 2); break;
+        case '\r': sykoJsonStreamPut(js, "\\r", 2); break;
+        case '\t': sykoJsonStreamPut(js, "\\t", 2); break;
+        default:
+            js->scratch_len = (uint8_t)snprintf(js->scratch, sizeof(js->scratch), "\\u%04x", c);
+            break;
+        }
+        break;
+
+    case SJS_RAW:
+        js->phase = SJS_NEXT;
+        break;
+
+    case SJS_VALUE:
+        js->phase = SJS_NEXT;
+        switch (item->type & 0xFF) {
+        case cJSON_False:
+            sykoJsonStreamPut(js, "false", 5);
+            break;
+        case cJSON_True:
+            sykoJsonStreamPut(js, "true", 4);
+            break;
+        case cJSON_Number:
+            sykoJsonStreamNumber(js, item);
+            break;
+        case cJSON_String:
+            sykoJsonStreamPut(js, "\"", 1);
+            sykoJsonStreamString(js, item->valuestring, "\"", SJS_NEXT);
+            break;
+        case cJSON_Raw:
+            js->str = item->valuestring ? item->valuestring : "";
+            js->phase = SJS_RAW;
+            break;
+        case cJSON_Array:
+        case cJSON_Object:
+            sykoJsonStreamPut(js, cJSON_IsArray(item) ? "[" : "{", 1);
+            if (!item->child) {
+                sykoJsonStreamPut(js, cJSON_IsArray(item) ? "]" : "}", 1);
+                break;
+            }
+            if (js->depth + 1 == SYKO_JSON_STREAM_DEPTH) {
+                // Too deep to resume, close it empty rather than emit garbage
+                sykoJsonStreamPut(js, cJSON_IsArray(item) ? "]" : "}", 1);
+                break;
+            }
+            js->stack[++js->depth] = item->child;
+            js->phase = SJS_START;
+            break;
+        default:
+            sykoJsonStreamPut(js, "null", 4);
+            break;
+        }
+        break;
+
+    case SJS_NEXT:
+        if (!js->depth) {
+            js->phase = SJS_DONE;
+            break;
+        }
+        if (item->next) {
+            sykoJsonStreamPut(js, ",", 1);
+            js->stack[js->depth] = item->next;
+            js->phase = SJS_START;
+            break;
+        }
+        js->depth--;
+        sykoJsonStreamPut(js, cJSON_IsArray(js->stack[js->depth]) ? "]" : "}", 1);
+        break;
+    }
+}
+
+/* Copy the run of bytes that need no escaping straight into the window */
+static size_t sykoJsonStreamSpan(struct syko_json_stream *js, uint8_t *buf, size_t len){
+    size_t n = 0;
+
+    if (js->phase == SJS_RAW) {
+        while (n < len && js->str[n])
+            n++;
+    } else {
+        while (n < len && (unsigned char)js->str[n] >= 0x20 &&
+               js->str[n] != '\"' && js->str[n] != '\\')
+            n++;
+    }
+
+    memcpy(buf, js->str, n);
+    js->str += n;
+
+    return n;
+}
+
+void sykoJsonStreamBegin(struct syko_json_stream *js, const cJSON *root){
+    memset(js, 0, sizeof(*js));
+    js->stack[0] = root;
+    js->phase = root ? SJS_START : SJS_DONE;
+}
+
+size_t sykoJsonStreamWrite(struct syko_json_stream *js, uint8_t *buf, size_t len){
+    size_t n, used = 0;
+
+    while (used < len) {
+        if (js->scratch_pos < js->scratch_len) {
+            n = (size_t)(js->scratch_len - js->scratch_pos);
+            if (n > len - used)
+                n = len - used;
+            memcpy(buf + used, js->scratch + js->scratch_pos, n);
+            js->scratch_pos = (uint8_t)(js->scratch_pos + n);
+            used += n;
+            continue;
+        }
+
+        if (js->phase == SJS_DONE)
+            break;
+
+        if (js->phase == SJS_STRING || js->phase == SJS_RAW) {
+            n = sykoJsonStreamSpan(js, buf + used, len - used);
+            used += n;
+            if (n)
+                continue;
+        }
+
+        sykoJsonStreamStep(js);
+    }
+
+    js->total += used;
+
+    return used;
+}
+
+int sykoJsonStreamDone(const struct syko_json_stream *js){
+    return js->phase == SJS_DONE && js->scratch_pos == js->scratch_len;
+}
@@ -0,0 +1,34 @@
+#ifndef SYKO_JSON_STREAM_H
+#define SYKO_JSON_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cjson.h>
+
+/*
+ * Resumable cJSON serializer. It writes unformatted JSON straight into
+ * whatever window the caller has (the Secure Streams tx buffer) and picks
+ * up where it stopped on the next call, so there is no intermediate string
+ * and no limit on the response size. The tree must stay alive until the
+ * stream is done.
+ */
+#define SYKO_JSON_STREAM_DEPTH  16
+
+struct syko_json_stream {
+    const cJSON *stack[SYKO_JSON_STREAM_DEPTH];
+    const char *str;
+    const char *str_close;
+    size_t total;
+    char scratch[32];
+    uint8_t scratch_len;
+    uint8_t scratch_pos;
+    uint8_t depth;
+    uint8_t phase;
+    uint8_t str_next;
+};
+
+void sykoJsonStreamBegin(struct syko_json_stream *js, const cJSON *root);
+size_t sykoJsonStreamWrite(struct syko_json_stream *js, uint8_t *buf, size_t len);
+int sykoJsonStreamDone(const struct syko_json_stream *js);
+
+#endif
@@ -0,0 +1,68 @@
+#include "syko_loop.h"
+#include "syko_worker.h"
+#include "syko_isotp.h"
+#include "syko_uds.h"
+#include "syko_canmon.h"
+#include "syko_upload.h"
+#include "syko_fwcache.h"
+
+static struct lws_vhost *loop_vhost;
+
+static int sykoLoopCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                            void *user, void *in, size_t len){
+    switch (reason) {
+    case LWS_CALLBACK_PROTOCOL_INIT:
+        return sykoWorkerInit(lws_get_context(wsi), SYKO_WORKER_THREADS);
+
+    case LWS_CALLBACK_PROTOCOL_DESTROY:
+        sykoWorkerDestroy();
+        sykoCanMonDestroy();
+        sykoUploadDestroy();
+        sykoFwCacheDestroy();
+        break;
+
+    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+        sykoWorkerService();
+        break;
+
+    case LWS_CALLBACK_RAW_RX_FILE:
+    case LWS_CALLBACK_RAW_WRITEABLE_FILE:
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
+        return sykoCanCallback(wsi, reason, user, in, len);
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+static const struct lws_protocols syko_loop_protocols[] = {
+    { "syko-loop", sykoLoopCallback, 0, 0, 0, NULL, 0 },
+    LWS_PROTOCOL_LIST_TERM
+};
+
+int sykoLoopInit(struct lws_context *cx){
+    struct lws_context_creation_info info;
+
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.vhost_name = "syko-loop";
+    info.protocols = syko_loop_protocols;
+
+    loop_vhost = lws_create_vhost(cx, &info);
+    if (!loop_vhost) {
+        lwsl_err("%s: vhost creation failed\n", __func__);
+        return 1;
+    }
+
+    if (sykoIsotpInit(cx) || sykoUdsInit(cx) || sykoCanMonInit() || sykoUploadInit(cx) ||
+        sykoFwCacheInit())
+        return 1;
+
+    return sykoCanAdopt(loop_vhost);
+}
+
+struct lws_vhost * sykoLoopVhost(){
+    return loop_vhost;
+}
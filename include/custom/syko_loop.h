@@ -0,0 +1,16 @@
+#ifndef SYKO_LOOP_H
+#define SYKO_LOOP_H
+
+#include <libwebsockets.h>
+
+/*
+ * Our own non-listening vhost and protocol on the lws context. It is how
+ * worker completions get back onto the service thread, it owns the worker
+ * pool lifetime and the CAN socket is adopted onto it as a raw file.
+ */
+#define SYKO_WORKER_THREADS     1   // Upload file work, one stream at a time mostly
+
+int sykoLoopInit(struct lws_context *cx);
+struct lws_vhost * sykoLoopVhost();
+
+#endif
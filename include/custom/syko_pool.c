@@ -0,0 +1,40 @@
+#include <libwebsockets.h>
+#include "syko_pool.h"
+
+void * sykoPoolAlloc(struct syko_pool *pool){
+    void *obj = pool->free_head;
+
+    if (obj) {
+        pool->free_head = *(void **)obj;
+        pool->free_count--;
+    } else {
+        obj = malloc(pool->size < sizeof(void *) ? sizeof(void *) : pool->size);
+        if (!obj) {
+            lwsl_err("%s: %s OOM\n", __func__, pool->name);
+            return NULL;
+        }
+    }
+
+    memset(obj, 0, pool->size);
+
+    if (++pool->in_use > pool->peak)
+        pool->peak = pool->in_use;
+
+    return obj;
+}
+
+void sykoPoolFree(struct syko_pool *pool, void *obj){
+    if (!obj)
+        return;
+
+    pool->in_use--;
+
+    if (pool->free_count == pool->max_free) {
+        free(obj);
+        return;
+    }
+
+    *(void **)obj = pool->free_head;
+    pool->free_head = obj;
+    pool->free_count++;
+}
@@ -0,0 +1,28 @@
+#ifndef SYKO_POOL_H
+#define SYKO_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Fixed-size object pool. Freed objects are kept on a free list, up to
+ * max_free of them, so steady request traffic does not go back to the heap
+ * and idle connections hold nothing. It recycles request decoders and
+ * queued responses and is not thread safe: only the lws service thread
+ * may use it. The worker threads are syko_worker.
+ */
+struct syko_pool {
+    const char *name;
+    size_t size;
+    unsigned int max_free;
+    void *free_head;
+    unsigned int free_count;
+    unsigned int in_use;
+    unsigned int peak;
+};
+
+#define SYKO_POOL_INIT(_name, _type, _max_free) { _name, sizeof(_type), _max_free, NULL, 0, 0, 0 }
+
+void * sykoPoolAlloc(struct syko_pool *pool);
+void sykoPoolFree(struct syko_pool *pool, void *obj);
+
+#endif
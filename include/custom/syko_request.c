@@ -0,0 +1,138 @@
+#include "syko_request.h"
+
+static const char * const syko_request_paths[] = {
+    "sequence",
+    "request",
+    "params.*",
+};
+
+enum syko_request_paths {
+    SRP_SEQUENCE = 1,
+    SRP_REQUEST,
+    SRP_PARAMS,
+};
+
+static struct syko_pool request_pool = SYKO_POOL_INIT("request", struct syko_request, 4);
+
+struct syko_request * sykoRequestCreate(){
+    return sykoPoolAlloc(&request_pool);
+}
+
+void sykoRequestDestroy(struct syko_request *req){
+    if (req && req->state == SYKO_REQ_PARSING)
+        lejp_destruct(&req->ctx);
+
+    sykoPoolFree(&request_pool, req);
+}
+
+static void sykoRequestAppend(struct syko_request *req, char *dest, uint8_t *dest_len,
+                              size_t size, const char *src, size_t len){
+    if (*dest_len + len >= size) {
+        req->seen |= SYKO_REQ_TRUNCATED;
+        len = size - 1 - *dest_len;
+    }
+
+    memcpy(dest + *dest_len, src, len);
+    *dest_len = (uint8_t)(*dest_len + len);
+    dest[*dest_len] = '\0';
+}
+
+static signed char sykoRequestCb(struct lejp_ctx *ctx, char reason){
+    struct syko_request *req = (struct syko_request *)ctx->user;
+    struct syko_request_param *param;
+
+    switch (ctx->path_match) {
+    case SRP_SEQUENCE:
+        if (reason == LEJPCB_VAL_NUM_INT) {
+            req->sequence = atoi(ctx->buf);
+            req->seen |= SYKO_REQ_SEEN_SEQUENCE;
+        }
+        break;
+
+    case SRP_REQUEST:
+        // Long strings arrive in LEJP_STRING_CHUNK pieces
+        if (reason == LEJPCB_VAL_STR_CHUNK || reason == LEJPCB_VAL_STR_END) {
+            sykoRequestAppend(req, req->request, &req->request_len,
+                              sizeof(req->request), ctx->buf, ctx->npos);
+            if (reason == LEJPCB_VAL_STR_END)
+                req->seen |= SYKO_REQ_SEEN_REQUEST;
+        }
+        break;
+
+    case SRP_PARAMS:
+        if (reason == LEJPCB_PAIR_NAME) {
+            if (req->param_count == SYKO_REQ_PARAMS_MAX) {
+                req->seen |= SYKO_REQ_TRUNCATED;
+                break;
+            }
+            param = &req->params[req->param_count++];
+            lws_strncpy(param->name, ctx->path + 7, sizeof(param->name));
+            param->value_len = 0;
+            param->value[0] = '\0';
+            break;
+        }
+
+        if (!(reason & LEJP_FLAG_CB_IS_VALUE) || !req->param_count)
+            break;
+
+        param = &req->params[req->param_count - 1];
+        sykoRequestAppend(req, param->value, &param->value_len,
+                          sizeof(param->value), ctx->buf, ctx->npos);
+        break;
+    }
+
+    return 0;
+}
+
+void sykoRequestBegin(struct syko_request *req){
+    if (req->state == SYKO_REQ_PARSING)
+        lejp_destruct(&req->ctx);
+
+    req->sequence = 0;
+    req->request_len = 0;
+    req->request[0] = '\0';
+    req->param_count = 0;
+    req->seen = 0;
+    req->state = SYKO_REQ_PARSING;
+
+    lejp_construct(&req->ctx, sykoRequestCb, req, syko_request_paths,
+                   LWS_ARRAY_SIZE(syko_request_paths));
+}
+
+/*
+ * Feed one rx fragment. Returns 1 when this fragment finished the request,
+ * successfully or not, and 0 while more fragments are needed. The request
+ * can end before the message does; the caller drops the rest of it.
+ */
+int sykoRequestParse(struct syko_request *req, const uint8_t *buf, size_t len, int flags){
+    int n;
+
+    if (req->state != SYKO_REQ_PARSING)
+        return 0;
+
+    n = lejp_parse(&req->ctx, buf, (int)len);
+
+    if (n == LEJP_CONTINUE && !(flags & LWSSS_FLAG_EOM))
+        return 0;
+
+    if (n < 0) {
+        lwsl_user("Request parse error: %s\n", n == LEJP_CONTINUE ?
+                  "truncated message" : lejp_error_to_string(n));
+        req->state = SYKO_REQ_FAILED;
+    } else
+        req->state = SYKO_REQ_DONE;
+
+    lejp_destruct(&req->ctx);
+
+    return 1;
+}
+
+const char * sykoRequestParam(const struct syko_request *req, const char *name){
+    int n;
+
+    for (n = 0; n < req->param_count; n++)
+        if (!strcmp(req->params[n].name, name))
+            return req->params[n].value;
+
+    return NULL;
+}
@@ -0,0 +1,55 @@
+#ifndef SYKO_REQUEST_H
+#define SYKO_REQUEST_H
+
+#include <libwebsockets.h>
+#include "syko_pool.h"
+
+/*
+ * Streaming request decoder. Routing fields and "params" members are pulled
+ * out by LEJP as the bytes arrive, so a request split over several rx
+ * callbacks is decoded without reassembly and without allocating. Decoders
+ * come from a pool and are only held while a request is being received.
+ */
+#define SYKO_REQ_NAME_MAX       64
+#define SYKO_REQ_PARAMS_MAX     8
+#define SYKO_REQ_PARAM_NAME     24
+#define SYKO_REQ_PARAM_VALUE    80      // Fits a hex SHA-256 or an image name with its NUL
+
+enum syko_request_state {
+    SYKO_REQ_IDLE = 0,
+    SYKO_REQ_PARSING,
+    SYKO_REQ_DONE,
+    SYKO_REQ_FAILED,
+};
+
+#define SYKO_REQ_SEEN_SEQUENCE  (1 << 0)
+#define SYKO_REQ_SEEN_REQUEST   (1 << 1)
+#define SYKO_REQ_TRUNCATED      (1 << 2)
+
+struct syko_request_param {
+    char name[SYKO_REQ_PARAM_NAME];
+    char value[SYKO_REQ_PARAM_VALUE];
+    uint8_t value_len;
+};
+
+struct syko_session;
+
+struct syko_request {
+    struct lejp_ctx ctx;
+    struct syko_session *session;   // Connection the request arrived on
+    int sequence;
+    char request[SYKO_REQ_NAME_MAX];
+    uint8_t request_len;
+    struct syko_request_param params[SYKO_REQ_PARAMS_MAX];
+    uint8_t param_count;
+    uint8_t seen;
+    uint8_t state;
+};
+
+struct syko_request * sykoRequestCreate();
+void sykoRequestDestroy(struct syko_request *req);
+void sykoRequestBegin(struct syko_request *req);
+int sykoRequestParse(struct syko_request *req, const uint8_t *buf, size_t len, int flags);
+const char * sykoRequestParam(const struct syko_request *req, const char *name);
+
+#endif
@@ -0,0 +1,46 @@
+#include "syko_session.h"
+#include "syko_request.h"
+#include "syko_upload.h"
+
+/*
+ * Sorts one rx fragment of the session's stream into request or image
+ * data. Returns 1 when it completed session->req, which the caller
+ * dispatches and then releases with sykoSessionRxDone(), 0 when there is
+ * nothing to do yet and <0 when the stream has to be dropped.
+ */
+int sykoSessionRx(struct syko_session *session, const uint8_t *buf, size_t len, int flags){
+    // Trailing bytes of a message whose request already ended and was dispatched
+    if (session->rx_drain && !(flags & LWSSS_FLAG_SOM)) {
+        if (flags & LWSSS_FLAG_EOM)
+            session->rx_drain = 0;
+        return 0;
+    }
+    session->rx_drain = 0;
+
+    // While an upload runs every message is image data, whatever its fragmentation
+    if (session->upload)
+        return sykoUploadRx(session, buf, len) ? -1 : 0;
+
+    // Requests may span several rx callbacks, LEJP keeps state between them
+    if ((flags & LWSSS_FLAG_SOM) || !session->req) {
+        if (!session->req)
+            session->req = sykoRequestCreate();
+        if (!session->req)
+            return -1;
+        sykoRequestBegin(session->req);
+        session->req->session = session;
+    }
+
+    if (!sykoRequestParse(session->req, buf, len, flags))
+        return 0;
+
+    if (!(flags & LWSSS_FLAG_EOM))
+        session->rx_drain = 1;
+
+    return 1;
+}
+
+void sykoSessionRxDone(struct syko_session *session){
+    sykoRequestDestroy(session->req);
+    session->req = NULL;
+}
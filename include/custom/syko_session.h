@@ -0,0 +1,35 @@
+#ifndef SYKO_SESSION_H
+#define SYKO_SESSION_H
+
+#include "syko_canmon.h"
+
+/*
+ * Per-connection state that outlives a single request, kept in the
+ * stream's user object. Handlers reach it through req->session.
+ */
+struct syko_request;
+
+struct syko_session {
+    struct syko_request *req;       // Only while a request is arriving
+    uint8_t rx_drain;               // Drop rx until EOM, the request is done
+    struct syko_can_sub can_sub;
+
+    /*
+     * Completes a SYKO_REPLY_PENDING reply by sequence, set by the stream.
+     * payload is raw JSON or NULL, the stream keeps its own copy.
+     */
+    void (*complete)(struct syko_session *session, int sequence, const char *status,
+                     const char *payload, size_t payload_len);
+
+    // Unsolicited messages are waiting, set by the stream
+    void (*wake)(struct syko_session *session);
+
+    lws_dll2_owner_t diag;          // struct syko_diag waiting for ECUs
+    lws_dll2_owner_t flashes;       // struct syko_flash this stream follows
+    struct syko_upload *upload;     // Rx is image data until this completes
+};
+
+int sykoSessionRx(struct syko_session *session, const uint8_t *buf, size_t len, int flags);
+void sykoSessionRxDone(struct syko_session *session);
+
+#endif
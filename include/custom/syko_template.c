@@ -0,0 +1,232 @@
+#include "syko_handler.h"
+#include "syko_template.h"
+
+static const struct {
+    const char *name;
+    uint8_t slot;
+} syko_template_slots[] = {
+    { "sequence", SYKO_TMPL_SEQUENCE },
+    { "response", SYKO_TMPL_RESPONSE },
+    { "status",   SYKO_TMPL_STATUS },
+    { "payload",  SYKO_TMPL_PAYLOAD },
+};
+
+static struct syko_template templates[commands_count];
+
+/*
+ * Replies of SYKO_CMD_F_CONST commands, rendered once around their
+ * sequence slot into an immutable body. Constant handlers don't look at
+ * the request, they get an empty one.
+ */
+static struct syko_template frozen[commands_count];
+static const struct syko_request frozen_req;
+
+static int sykoTemplateAdd(struct syko_template *t, uint8_t slot, size_t ofs, size_t len){
+    if (t->count == SYKO_TMPL_SEGS_MAX)
+        return 1;
+
+    t->segs[t->count].slot = slot;
+    t->segs[t->count].ofs = (uint16_t)ofs;
+    t->segs[t->count].len = (uint16_t)len;
+    t->count++;
+
+    return 0;
+}
+
+static int sykoTemplateCompile(struct syko_template *t, const char *skel){
+    const char *p = skel, *open, *close;
+    size_t n;
+
+    t->skel = skel;
+    t->count = 0;
+
+    while (*p) {
+        open = strstr(p, "{{");
+        if (!open)
+            open = p + strlen(p);
+
+        if (open > p && sykoTemplateAdd(t, SYKO_TMPL_LITERAL, (size_t)(p - skel), (size_t)(open - p)))
+            return 1;
+
+        if (!*open)
+            break;
+
+        close = strstr(open + 2, "}}");
+        if (!close)
+            return 1;
+
+        for (n = 0; n < LWS_ARRAY_SIZE(syko_template_slots); n++)
+            if (strlen(syko_template_slots[n].name) == (size_t)(close - open - 2) &&
+                !strncmp(syko_template_slots[n].name, open + 2, (size_t)(close - open - 2)))
+                break;
+
+        if (n == LWS_ARRAY_SIZE(syko_template_slots) ||
+            sykoTemplateAdd(t, syko_template_slots[n].slot, 0, 0))
+            return 1;
+
+        p = close + 2;
+    }
+
+    return 0;
+}
+
+/* What a segment writes, NULL for a payload tree; never called for the sequence */
+static const char * sykoTemplateText(const struct syko_template *t, const struct syko_template_seg *seg,
+                                     const struct syko_reply *reply, size_t *len){
+    switch (seg->slot) {
+    case SYKO_TMPL_LITERAL:
+        *len = seg->len;
+        return t->skel + seg->ofs;
+    case SYKO_TMPL_RESPONSE:
+        *len = strlen(reply->response);
+        return reply->response;
+    case SYKO_TMPL_STATUS:
+        *len = strlen(reply->status);
+        return reply->status;
+    case SYKO_TMPL_PAYLOAD:
+        if (reply->payload_json)
+            return NULL;
+        *len = reply->payload ? reply->payload_len : 4;
+        return reply->payload ? reply->payload : "null";
+    }
+
+    return NULL;
+}
+
+/* Everything but the sequence slot goes into one literal body */
+static int sykoTemplateFreeze(struct syko_template *f, const struct syko_template *t,
+                              const struct syko_reply *reply){
+    size_t size = 0, ofs = 0, start = 0, len;
+    const char *src;
+    char *body;
+    uint8_t n;
+
+    for (n = 0; n < t->count; n++) {
+        if (t->segs[n].slot == SYKO_TMPL_SEQUENCE)
+            continue;
+        if (!sykoTemplateText(t, &t->segs[n], reply, &len))
+            return 1;
+        size += len;
+    }
+
+    // Segment offsets are 16 bit
+    if (size > 0xFFFF)
+        return 1;
+
+    body = malloc(size + 1);
+    if (!body)
+        return 1;
+
+    free((void *)f->skel);
+    f->skel = body;
+    f->count = 0;
+
+    for (n = 0; n < t->count; n++) {
+        if (t->segs[n].slot == SYKO_TMPL_SEQUENCE) {
+            if (ofs > start)
+                sykoTemplateAdd(f, SYKO_TMPL_LITERAL, start, ofs - start);
+            sykoTemplateAdd(f, SYKO_TMPL_SEQUENCE, 0, 0);
+            start = ofs;
+            continue;
+        }
+
+        src = sykoTemplateText(t, &t->segs[n], reply, &len);
+        memcpy(body + ofs, src, len);
+        ofs += len;
+    }
+
+    if (ofs > start)
+        sykoTemplateAdd(f, SYKO_TMPL_LITERAL, start, ofs - start);
+    body[size] = '\0';
+
+    return 0;
+}
+
+/* Also renders the constant replies again, after anything they show has changed */
+int sykoTemplateInit(){
+    const struct syko_command *cmd;
+    struct syko_reply reply;
+    unsigned int n;
+
+    for (n = 0; n < commands_count; n++) {
+        cmd = sykoCommandsGet(n);
+        if (sykoTemplateCompile(&templates[n], cmd->tmpl)) {
+            lwsl_err("%s: bad template for %s\n", __func__, n ? cmd->name : "unknown");
+            return 1;
+        }
+
+        if (!(cmd->flags & SYKO_CMD_F_CONST))
+            continue;
+
+        // As ss_server would fill it in before the handler
+        memset(&reply, 0, sizeof(reply));
+        reply.response = cmd->name;
+        reply.status = "ok";
+
+        if (cmd->fnc(&frozen_req, &reply) || sykoTemplateFreeze(&frozen[n], &templates[n], &reply)) {
+            lwsl_err("%s: %s can't be constant\n", __func__, n ? cmd->name : "unknown");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+const struct syko_template * sykoTemplateGet(unsigned int id){
+    return &templates[id < commands_count ? id : unknown_command];
+}
+
+/* The rendered reply of a SYKO_CMD_F_CONST command, only the sequence is filled in */
+const struct syko_template * sykoTemplateConst(unsigned int id){
+    return id < commands_count && frozen[id].skel ? &frozen[id] : NULL;
+}
+
+void sykoTemplateBegin(struct syko_template_cursor *cur, const struct syko_reply *reply){
+    cur->seg = 0;
+    cur->pos = 0;
+    cur->seq_len = (uint8_t)lws_snprintf(cur->seq, sizeof(cur->seq), "%d", reply->sequence);
+
+    if (reply->payload_json)
+        sykoJsonStreamBegin(&cur->js, reply->payload_json);
+}
+
+size_t sykoTemplateWrite(const struct syko_template *t, const struct syko_reply *reply,
+                         struct syko_template_cursor *cur, uint8_t *buf, size_t len){
+    const struct syko_template_seg *seg;
+    const char *src = NULL;
+    size_t n, avail = 0, used = 0;
+
+    while (used < len && cur->seg < t->count) {
+        seg = &t->segs[cur->seg];
+
+        if (seg->slot == SYKO_TMPL_SEQUENCE) {
+            src = cur->seq;
+            avail = cur->seq_len;
+        } else if (!(src = sykoTemplateText(t, seg, reply, &avail))) {
+            used += sykoJsonStreamWrite(&cur->js, buf + used, len - used);
+            if (!sykoJsonStreamDone(&cur->js))
+                return used;
+            cur->seg++;
+            continue;
+        }
+
+        n = avail - cur->pos;
+        if (n > len - used)
+            n = len - used;
+
+        memcpy(buf + used, src + cur->pos, n);
+        used += n;
+        cur->pos += n;
+
+        if (cur->pos == avail) {
+            cur->seg++;
+            cur->pos = 0;
+        }
+    }
+
+    return used;
+}
+
+int sykoTemplateDone(const struct syko_template *t, const struct syko_template_cursor *cur){
+    return cur->seg == t->count;
+}
@@ -0,0 +1,67 @@
+#ifndef SYKO_TEMPLATE_H
+#define SYKO_TEMPLATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cjson.h>
+#include "syko_json_stream.h"
+
+/*
+ * Response templates. Each command declares its JSON skeleton once, with
+ * {{sequence}}, {{response}}, {{status}} and {{payload}} slots. Skeletons
+ * are compiled at startup into literal spans of the immutable skeleton and
+ * slots; a response is then written in one pass straight into the caller's
+ * buffer, resuming where it stopped, with no DOM and no intermediate copy.
+ *
+ * Commands whose reply never changes have it rendered at startup into a
+ * template of its own, literal but for the sequence; see SYKO_CMD_F_CONST.
+ */
+#define SYKO_TMPL_SEGS_MAX  16
+
+enum syko_template_slot {
+    SYKO_TMPL_LITERAL = 0,
+    SYKO_TMPL_SEQUENCE,
+    SYKO_TMPL_RESPONSE,
+    SYKO_TMPL_STATUS,
+    SYKO_TMPL_PAYLOAD,
+};
+
+struct syko_template_seg {
+    uint8_t slot;
+    uint16_t ofs;
+    uint16_t len;
+};
+
+struct syko_template {
+    const char *skel;
+    struct syko_template_seg segs[SYKO_TMPL_SEGS_MAX];
+    uint8_t count;
+};
+
+/* Filled in by the command handler, strings must outlive the response */
+struct syko_reply {
+    int sequence;
+    const char *response;
+    const char *status;
+    const char *payload;        // Raw JSON value, or
+    size_t payload_len;
+    const cJSON *payload_json;  // a tree in the response arena
+};
+
+struct syko_template_cursor {
+    uint8_t seg;
+    size_t pos;
+    char seq[12];
+    uint8_t seq_len;
+    struct syko_json_stream js;
+};
+
+int sykoTemplateInit();
+const struct syko_template * sykoTemplateGet(unsigned int id);
+const struct syko_template * sykoTemplateConst(unsigned int id);
+void sykoTemplateBegin(struct syko_template_cursor *cur, const struct syko_reply *reply);
+size_t sykoTemplateWrite(const struct syko_template *t, const struct syko_reply *reply,
+                         struct syko_template_cursor *cur, uint8_t *buf, size_t len);
+int sykoTemplateDone(const struct syko_template *t, const struct syko_template_cursor *cur);
+
+#endif
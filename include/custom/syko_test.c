@@ -0,0 +1,237 @@
+#include "syko_test.h"
+#include "syko_arena.h"
+#include "syko_flash.h"
+#include "syko_fwcache.h"
+#include "syko_handler.h"
+#include "syko_request.h"
+#include "syko_session.h"
+#include "syko_upload.h"
+#include "syko_worker.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TEST_SHA256     "9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08"  // "test"
+
+static const char test_upload_req[] =
+    "{\"sequence\":7,\"request\":\"remotegui/upload-image\",\"params\":"
+    "{\"image\":\"selftest.bin\",\"size\":4,\"sha256\":\"" TEST_SHA256 "\"}}";
+
+static int test_fails;
+static int test_completed, test_woken;
+static const char *test_status;
+static char test_payload[64];
+
+static void sykoTestCheck(const char *name, int ok){
+    lwsl_user("test %-44s %s\n", name, ok ? "ok" : "FAIL");
+    if (!ok)
+        test_fails++;
+}
+
+/* Feeds one message in pieces of at most step bytes, as rx callbacks would */
+static int sykoTestParse(struct syko_request *req, const char *msg, size_t len, size_t step){
+    size_t pos, n;
+    int done = 0;
+
+    for (pos = 0; pos < len && !done; pos += n) {
+        n = len - pos < step ? len - pos : step;
+        done = sykoRequestParse(req, (const uint8_t *)msg + pos, n,
+                                (!pos ? LWSSS_FLAG_SOM : 0) | (pos + n == len ? LWSSS_FLAG_EOM : 0));
+    }
+
+    return done;
+}
+
+/* A whole hex SHA-256 has to reach the handler, however the request is split */
+static void sykoTestRequestSha256(){
+    static const size_t steps[] = { sizeof(test_upload_req) - 1, 100, 7, 1 };
+    const struct syko_command *cmd;
+    struct syko_request *req;
+    const char *sha256;
+    char name[64];
+    int done;
+
+    for (size_t i = 0; i < LWS_ARRAY_SIZE(steps); i++) {
+        req = sykoRequestCreate();
+        if (!req) {
+            sykoTestCheck("request pool", 0);
+            return;
+        }
+
+        sykoRequestBegin(req);
+        done = sykoTestParse(req, test_upload_req, sizeof(test_upload_req) - 1, steps[i]);
+        sha256 = sykoRequestParam(req, "sha256");
+        cmd = sykoCommandsHandler(req);
+
+        lws_snprintf(name, sizeof(name), "request sha256, %zu byte pieces", steps[i]);
+        sykoTestCheck(name, done && !(req->seen & SYKO_REQ_TRUNCATED) &&
+                            cmd->id == remotegui_upload_image &&
+                            sha256 && !strcmp(sha256, TEST_SHA256));
+
+        sykoRequestDestroy(req);
+    }
+}
+
+static void sykoTestComplete(struct syko_session *session, int sequence, const char *status,
+                             const char *payload, size_t payload_len){
+    test_completed = 1;
+    test_status = status;
+    lws_strnncpy(test_payload, payload ? payload : "", payload_len, sizeof(test_payload));
+}
+
+static void sykoTestWake(struct syko_session *session){
+    test_woken = 1;
+}
+
+/* Hands worker completions to the loop's thread, as the loop would, until *flag */
+static int sykoTestWait(const int *flag){
+    for (int i = 0; i < 5000 && !*flag; i++) {
+        sykoWorkerService();
+        if (!*flag)
+            usleep(1000);
+    }
+
+    return *flag;
+}
+
+/* Runs a dispatched request's handler the way the stream does */
+static int sykoTestHandle(struct syko_session *session, struct syko_reply *reply, int *cached){
+    const struct syko_command *cmd = sykoCommandsHandler(session->req);
+    const cJSON *item;
+    struct syko_arena arena;
+    int n;
+
+    memset(reply, 0, sizeof(*reply));
+    test_completed = 0;
+    sykoArenaBegin(&arena);
+    n = cmd->fnc(session->req, reply);
+    sykoArenaDetach();
+    item = reply->payload_json ? cJSON_GetObjectItem(reply->payload_json, "cached") : NULL;
+    *cached = cJSON_IsTrue(item);
+    sykoArenaEnd(&arena);
+    sykoSessionRxDone(session);
+
+    // A new upload's offset comes once a worker has made its file
+    if (n == SYKO_REPLY_PENDING) {
+        n = sykoTestWait(&test_completed) && !strcmp(test_status, "ok") ? 0 : -1;
+        *cached = !!strstr(test_payload, "\"cached\"");
+    }
+
+    return cmd->id == remotegui_upload_image && !n && !reply->status ? 0 : -1;
+}
+
+/*
+ * upload-image split over two rx callbacks, its message going on past the
+ * end of the JSON, then the image in two messages of its own. The rest
+ * of the request message has to be dropped, not taken for image data.
+ * Asking for the same image again is then answered from the cache.
+ */
+static void sykoTestUploadSplit(){
+    static const char tail[] = "  \r\n";
+    size_t len = sizeof(test_upload_req) - 1, half = len / 2;
+    struct syko_session session;
+    struct syko_reply reply;
+    char done[SYKO_UPLOAD_MSG_MIN * 2];
+    int n, cached;
+
+    memset(&session, 0, sizeof(session));
+    session.complete = sykoTestComplete;
+    session.wake = sykoTestWake;
+
+    n = sykoSessionRx(&session, (const uint8_t *)test_upload_req, half, LWSSS_FLAG_SOM);
+    sykoTestCheck("upload split, first half waits", !n);
+
+    n = sykoSessionRx(&session, (const uint8_t *)test_upload_req + half, len - half, 0);
+    sykoTestCheck("upload split, request ends before message", n == 1 && session.rx_drain);
+    if (n != 1) {
+        sykoSessionRxDone(&session);
+        return;
+    }
+
+    n = sykoTestHandle(&session, &reply, &cached);
+    sykoTestCheck("upload split, upload starts", !n && !cached && session.upload);
+    if (n || !session.upload)
+        goto out;
+
+    n = sykoSessionRx(&session, (const uint8_t *)tail, sizeof(tail) - 1, LWSSS_FLAG_EOM);
+    sykoTestCheck("upload split, rest of request dropped", !n && !session.rx_drain && session.upload);
+
+    test_woken = 0;
+    n = sykoSessionRx(&session, (const uint8_t *)"te", 2, LWSSS_FLAG_SOM);
+    n |= sykoSessionRx(&session, (const uint8_t *)"st", 2, LWSSS_FLAG_EOM);
+    done[0] = '\0';
+    if (!n && !session.upload && sykoTestWait(&test_woken))
+        sykoUploadWrite(&session, (uint8_t *)done, sizeof(done));
+    sykoTestCheck("upload split, image matches its sha256",
+                  strstr(done, "\"bytes\":4,") && strstr(done, "\"status\":\"ok\""));
+
+    n = sykoSessionRx(&session, (const uint8_t *)test_upload_req, len,
+                      LWSSS_FLAG_SOM | LWSSS_FLAG_EOM);
+    if (n == 1)
+        n = sykoTestHandle(&session, &reply, &cached);
+    sykoTestCheck("upload again, served from the cache", !n && cached && !session.upload);
+
+out:
+    sykoUploadClose(&session);
+}
+
+/*
+ * After the upload: a flash by sha256 takes only 64 hex digits, a flash by
+ * name only a valid name, and neither is ever looked up as the other.
+ */
+static void sykoTestFlashKeys(){
+    struct syko_fwcache_entry *e;
+    struct syko_session session;
+
+    memset(&session, 0, sizeof(session));
+    sykoTestCheck("flash sha256 not hex refused",
+                  sykoFlashStart(&session, 1, ecu_main, NULL, "../selftest.bin", 0) == -EINVAL);
+    sykoTestCheck("flash sha256 too short refused",
+                  sykoFlashStart(&session, 1, ecu_main, NULL, "9f86d081", 0) == -EINVAL);
+    sykoTestCheck("flash name with a path refused",
+                  sykoFlashStart(&session, 1, ecu_main, "../selftest.bin", NULL, 0) == -EINVAL);
+
+    e = sykoFwCacheGetName("selftest.bin");
+    sykoTestCheck("cache by name", e && e->size == 4);
+    if (e)
+        sykoFwCachePut(e);
+    e = sykoFwCacheGet(TEST_SHA256);
+    sykoTestCheck("cache by sha256", e && e->size == 4);
+    if (e)
+        sykoFwCachePut(e);
+    sykoTestCheck("cache name not taken for a sha256", !sykoFwCacheGet("selftest.bin"));
+    sykoTestCheck("cache sha256 not taken for a name", !sykoFwCacheGetName(TEST_SHA256));
+}
+
+/*
+ * Uploads go to a firmware cache in a scratch directory, swapped in for
+ * the real one while the tests run and removed after.
+ */
+int sykoTestRun(struct lws_context *cx){
+    char cwd[256], scratch[] = "/tmp/syko-test-XXXXXX";
+
+    test_fails = 0;
+
+    if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(scratch) || chdir(scratch)) {
+        lwsl_err("%s: no scratch directory\n", __func__);
+        return 1;
+    }
+    sykoFwCacheDestroy();
+    if (sykoFwCacheInit())
+        test_fails++;
+
+    sykoTestRequestSha256();
+    sykoTestUploadSplit();
+    sykoTestFlashKeys();
+
+    sykoFwCacheDestroy();
+    if (chdir(cwd) || sykoFwCacheInit())
+        test_fails++;
+    lws_dir(scratch, NULL, lws_dir_rm_rf_cb);
+    rmdir(scratch);
+
+    lwsl_user("%d test failures\n", test_fails);
+
+    return test_fails;
+}
@@ -0,0 +1,19 @@
+#ifndef SYKO_TEST_H
+#define SYKO_TEST_H
+
+#include <libwebsockets.h>
+
+/*
+ * Self tests of the request path, run instead of serving with
+ *
+ *   ./main --test
+ *
+ * They drive the session rx path and handlers directly on the loop's
+ * thread after sykoLoopInit(), with uploads going to a scratch firmware
+ * cache under /tmp, and log one line per check. The loop isn't running,
+ * so they hand worker completions back themselves. The result is the
+ * number of failed checks, for lws_cmdline_passfail().
+ */
+int sykoTestRun(struct lws_context *cx);
+
+#endif
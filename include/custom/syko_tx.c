@@ -0,0 +1,125 @@
+#include "syko_tx.h"
+#include "syko_pool.h"
+
+static struct syko_pool response_pool = SYKO_POOL_INIT("response", struct syko_response, 16);
+
+struct syko_response * sykoResponseCreate(lws_dll2_owner_t *queue){
+    struct syko_response *rsp = sykoPoolAlloc(&response_pool);
+
+    if (rsp)
+        lws_dll2_add_tail(&rsp->list, queue);
+
+    return rsp;
+}
+
+void sykoResponseDestroy(struct syko_response *rsp){
+    lws_dll2_remove(&rsp->list);
+    lws_buflist_destroy_all_segments(&rsp->bl);
+    sykoArenaEnd(&rsp->arena);
+    sykoPoolFree(&response_pool, rsp);
+}
+
+int sykoResponseAppend(struct syko_response *rsp, const void *buf, size_t len){
+    return lws_buflist_append_segment(&rsp->bl, (const uint8_t *)buf, len) < 0;
+}
+
+/* Anything the reply points into must live in rsp->arena or be static */
+void sykoResponseTemplate(struct syko_response *rsp, const struct syko_template *tmpl){
+    rsp->tmpl = tmpl;
+    sykoTemplateBegin(&rsp->cur, &rsp->reply);
+    rsp->kind = SYKO_RSP_TEMPLATE;
+}
+
+void sykoResponseReady(struct syko_response *rsp){
+    rsp->ready = 1;
+}
+
+/* Pending response for a sequence, for completions that arrive later */
+struct syko_response * sykoTxFind(lws_dll2_owner_t *queue, int sequence){
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(queue)) {
+        struct syko_response *rsp = lws_container_of(d, struct syko_response, list);
+
+        if (!rsp->ready && rsp->kind == SYKO_RSP_TEMPLATE && rsp->reply.sequence == sequence)
+            return rsp;
+    } lws_end_foreach_dll(d);
+
+    return NULL;
+}
+
+/*
+ * The response to send next: the one already part way out, which is always
+ * at the head, or else the first ready one.
+ */
+static struct syko_response * sykoTxNext(lws_dll2_owner_t *queue){
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(queue)) {
+        struct syko_response *rsp = lws_container_of(d, struct syko_response, list);
+
+        if (rsp->sent || rsp->ready)
+            return rsp;
+    } lws_end_foreach_dll(d);
+
+    return NULL;
+}
+
+int sykoTxReady(lws_dll2_owner_t *queue){
+    return sykoTxNext(queue) != NULL;
+}
+
+/*
+ * Fill one tx window from the next ready response. Each response is one
+ * message, so a window never mixes two of them. Returns nonzero if another
+ * ready response, or the rest of this one, is waiting afterwards.
+ */
+int sykoTxWrite(lws_dll2_owner_t *queue, uint8_t *buf, size_t *len, int *flags){
+    struct syko_response *rsp = sykoTxNext(queue);
+    uint8_t *seg;
+    size_t n, chunk;
+    int done;
+
+    if (!rsp) {
+        *len = 0;
+        return 0;
+    }
+
+    if (!rsp->sent) {
+        *flags |= LWSSS_FLAG_SOM;
+        // Keep it at the head until its last byte is out
+        lws_dll2_remove(&rsp->list);
+        lws_dll2_add_head(&rsp->list, queue);
+    }
+
+    switch (rsp->kind) {
+    case SYKO_RSP_TEMPLATE:
+        *len = sykoTemplateWrite(rsp->tmpl, &rsp->reply, &rsp->cur, buf, *len);
+        done = sykoTemplateDone(rsp->tmpl, &rsp->cur);
+        break;
+
+    default:
+        n = 0;
+        while (n < *len && (chunk = lws_buflist_next_segment_len(&rsp->bl, &seg))) {
+            if (chunk > *len - n)
+                chunk = *len - n;
+            memcpy(buf + n, seg, chunk);
+            lws_buflist_use_segment(&rsp->bl, chunk);
+            n += chunk;
+        }
+        *len = n;
+        done = !rsp->bl;
+        break;
+    }
+
+    rsp->sent += *len;
+
+    if (done) {
+        *flags |= LWSSS_FLAG_EOM;
+        sykoResponseDestroy(rsp);
+    }
+
+    return sykoTxReady(queue);
+}
+
+void sykoTxFlush(lws_dll2_owner_t *queue){
+    lws_start_foreach_dll_safe(struct lws_dll2 *, d, d1, lws_dll2_get_head(queue)) {
+        sykoResponseDestroy(lws_container_of(d, struct syko_response, list));
+    } lws_end_foreach_dll_safe(d, d1);
+}
@@ -0,0 +1,51 @@
+#ifndef SYKO_TX_H
+#define SYKO_TX_H
+
+#include <libwebsockets.h>
+#include "syko_arena.h"
+#include "syko_template.h"
+
+/*
+ * Outbound responses. Each stream keeps a queue of pooled response objects;
+ * a response is either a command template filled on the fly into the tx
+ * window or a chain of byte segments on an lws_buflist. Either way it can
+ * be any size and drains over as many tx callbacks as it needs.
+ *
+ * Clients may pipeline requests. A response is queued when its request
+ * arrives but is only sent once it is ready, so responses go out in
+ * completion order and the client matches them up by sequence.
+ *
+ * Past SYKO_TX_INFLIGHT_MAX queued responses requests are answered "busy",
+ * and past SYKO_TX_BUSY_MAX of those the stream is dropped, so a client
+ * that sends without reading can't grow the queue without bound.
+ */
+#define SYKO_TX_INFLIGHT_MAX    32
+#define SYKO_TX_BUSY_MAX        4
+enum syko_response_kind {
+    SYKO_RSP_BYTES = 0,     // lws_buflist segments
+    SYKO_RSP_TEMPLATE,      // Command template plus the handler's reply
+};
+
+struct syko_response {
+    lws_dll2_t list;
+    struct syko_arena arena;
+    struct lws_buflist *bl;
+    const struct syko_template *tmpl;
+    struct syko_reply reply;
+    struct syko_template_cursor cur;
+    size_t sent;
+    uint8_t kind;
+    uint8_t ready;
+};
+
+struct syko_response * sykoResponseCreate(lws_dll2_owner_t *queue);
+void sykoResponseDestroy(struct syko_response *rsp);
+int sykoResponseAppend(struct syko_response *rsp, const void *buf, size_t len);
+void sykoResponseTemplate(struct syko_response *rsp, const struct syko_template *tmpl);
+void sykoResponseReady(struct syko_response *rsp);
+struct syko_response * sykoTxFind(lws_dll2_owner_t *queue, int sequence);
+int sykoTxReady(lws_dll2_owner_t *queue);
+int sykoTxWrite(lws_dll2_owner_t *queue, uint8_t *buf, size_t *len, int *flags);
+void sykoTxFlush(lws_dll2_owner_t *queue);
+
+#endif
@@ -0,0 +1,235 @@
+#include "syko_uds.h"
+
+#include <errno.h>
+
+struct syko_uds {
+    lws_sorted_usec_list_t sul;     // P2 / P2* while a request is out
+    lws_sorted_usec_list_t s3;      // TesterPresent in a non-default session
+    syko_uds_cb done;
+    void *opaque;
+    lws_usec_t p2, p2x;
+    uint8_t busy;
+    uint8_t sid;                    // Service of the request in flight
+    uint8_t sub;
+    uint8_t pending;                // 0x78 seen for this request
+    uint8_t receiving;              // Our response is arriving segmented, P2 is met
+    uint8_t session;
+};
+
+static struct lws_context *uds_cx;
+static struct syko_uds uds_ecus[syko_ecus_count];
+
+static enum syko_ecus sykoUdsIndex(const struct syko_uds *u){
+    return (enum syko_ecus)(u - uds_ecus);
+}
+
+static void sykoUdsKeepAlive(lws_sorted_usec_list_t *sul){
+    struct syko_uds *u = lws_container_of(sul, struct syko_uds, s3);
+    static const uint8_t tp[] = { SYKO_UDS_TESTER_PRESENT, SYKO_UDS_SUPPRESS_POS };
+
+    if (u->session == SYKO_UDS_SESSION_DEFAULT)
+        return;
+
+    // A request in flight keeps the session alive by itself
+    if (!u->busy)
+        sykoIsotpSend(sykoUdsIndex(u), tp, sizeof(tp), NULL, NULL);
+
+    lws_sul_schedule(uds_cx, 0, &u->s3, sykoUdsKeepAlive, SYKO_UDS_S3_US);
+}
+
+/* Session bookkeeping from positive responses, before the caller sees them */
+static void sykoUdsTrack(struct syko_uds *u, const uint8_t *rsp, size_t len){
+    switch (u->sid) {
+    case SYKO_UDS_SESSION_CONTROL:
+        u->session = u->sub & 0x7F;
+        if (len >= 6) {
+            u->p2 = (lws_usec_t)((rsp[2] << 8) | rsp[3]) * LWS_US_PER_MS;
+            u->p2x = (lws_usec_t)((rsp[4] << 8) | rsp[5]) * 10 * LWS_US_PER_MS;
+        }
+        break;
+
+    case SYKO_UDS_ECU_RESET:
+        u->session = SYKO_UDS_SESSION_DEFAULT;
+        u->p2 = SYKO_UDS_P2_US;
+        u->p2x = SYKO_UDS_P2X_US;
+        break;
+
+    default:
+        return;
+    }
+
+    if (u->session == SYKO_UDS_SESSION_DEFAULT)
+        lws_sul_cancel(&u->s3);
+    else
+        lws_sul_schedule(uds_cx, 0, &u->s3, sykoUdsKeepAlive, SYKO_UDS_S3_US);
+}
+
+static void sykoUdsFinish(struct syko_uds *u, int err, const uint8_t *rsp, size_t len){
+    syko_uds_cb done = u->done;
+
+    lws_sul_cancel(&u->sul);
+    sykoIsotpOnRx(sykoUdsIndex(u), NULL, NULL);
+    u->busy = 0;
+    u->receiving = 0;
+    u->done = NULL;
+
+    if (!err)
+        sykoUdsTrack(u, rsp, len);
+    else if (err < 0)
+        lwsl_warn("%s: %s service 0x%02X failed %d\n", __func__,
+                  sykoIsotpEcu(sykoUdsIndex(u))->name, u->sid, err);
+
+    if (done)
+        done(sykoUdsIndex(u), err, rsp, len, u->opaque);
+}
+
+static void sykoUdsTimeout(lws_sorted_usec_list_t *sul){
+    struct syko_uds *u = lws_container_of(sul, struct syko_uds, sul);
+
+    sykoUdsFinish(u, -ETIMEDOUT, NULL, 0);
+}
+
+/* The request is on its way, P2 runs from here */
+static void sykoUdsSent(enum syko_ecus ecu, int err, void *opaque){
+    struct syko_uds *u = opaque;
+
+    if (!u->busy)
+        return;
+
+    if (err) {
+        sykoUdsFinish(u, err, NULL, 0);
+        return;
+    }
+
+    if (!u->receiving)
+        lws_sul_schedule(uds_cx, 0, &u->sul, sykoUdsTimeout, u->p2 + SYKO_UDS_MARGIN_US);
+}
+
+/*
+ * The first frame of our positive response ends P2, however long the
+ * rest takes to arrive. If ISO-TP gives up on it, so do we.
+ */
+static void sykoUdsSegment(enum syko_ecus ecu, const uint8_t *head, size_t len, int err, void *opaque){
+    struct syko_uds *u = opaque;
+
+    if (!u->busy)
+        return;
+
+    if (err) {
+        if (u->receiving)
+            sykoUdsFinish(u, err, NULL, 0);
+        return;
+    }
+
+    if (head[0] == (u->sid | 0x40)) {
+        u->receiving = 1;
+        lws_sul_cancel(&u->sul);
+    }
+}
+
+static void sykoUdsRx(enum syko_ecus ecu, const uint8_t *buf, size_t len, void *opaque){
+    struct syko_uds *u = opaque;
+
+    if (!u->busy || !len)
+        return;
+
+    if (buf[0] == SYKO_UDS_NEGATIVE) {
+        if (len < 3 || buf[1] != u->sid)
+            return;
+
+        if (buf[2] == SYKO_UDS_NRC_PENDING && ++u->pending <= SYKO_UDS_PENDING_MAX) {
+            lws_sul_schedule(uds_cx, 0, &u->sul, sykoUdsTimeout, u->p2x + SYKO_UDS_MARGIN_US);
+            return;
+        }
+
+        sykoUdsFinish(u, buf[2], buf, len);
+        return;
+    }
+
+    // Anything that isn't the answer to our request is not for us
+    if (buf[0] == (u->sid | 0x40))
+        sykoUdsFinish(u, 0, buf, len);
+}
+
+static int sykoUdsStart(enum syko_ecus ecu, const uint8_t *hdr, size_t hlen,
+                        const uint8_t *req, size_t len, syko_uds_cb done, void *opaque){
+    struct syko_uds *u;
+    int n;
+
+    if ((unsigned)ecu >= syko_ecus_count || (hlen ? hlen < 2 : !len))
+        return -EINVAL;
+
+    u = &uds_ecus[ecu];
+    if (u->busy)
+        return -EBUSY;
+
+    u->busy = 1;
+    u->sid = hlen ? hdr[0] : req[0];
+    u->sub = hlen ? hdr[1] : len > 1 ? req[1] : 0;
+    u->pending = 0;
+    u->receiving = 0;
+
+    // Listen before sending, a single frame may be answered straight away
+    sykoIsotpOnRx(ecu, sykoUdsRx, u);
+    sykoIsotpOnSegment(ecu, sykoUdsSegment);
+    n = hlen ? sykoIsotpSendRef(ecu, hdr, hlen, req, len, sykoUdsSent, u) :
+               sykoIsotpSend(ecu, req, len, sykoUdsSent, u);
+    if (n) {
+        sykoIsotpOnRx(ecu, NULL, NULL);
+        u->busy = 0;
+        return n;
+    }
+
+    u->done = done;
+    u->opaque = opaque;
+
+    return 0;
+}
+
+int sykoUdsRequest(enum syko_ecus ecu, const uint8_t *req, size_t len,
+                   syko_uds_cb done, void *opaque){
+    return sykoUdsStart(ecu, NULL, 0, req, len, done, opaque);
+}
+
+/*
+ * The request is hdr (SID and at least one more byte) followed by data,
+ * which is sent in place and must stay valid until done() is called.
+ */
+int sykoUdsRequestRef(enum syko_ecus ecu, const uint8_t *hdr, size_t hlen,
+                      const uint8_t *data, size_t len, syko_uds_cb done, void *opaque){
+    return sykoUdsStart(ecu, hdr, hlen, data, len, done, opaque);
+}
+
+uint8_t sykoUdsSession(enum syko_ecus ecu){
+    return uds_ecus[ecu].session;
+}
+
+/* Stops TesterPresent, the ECU falls back to the default session by itself after S3 */
+void sykoUdsRelease(enum syko_ecus ecu){
+    struct syko_uds *u = &uds_ecus[ecu];
+
+    lws_sul_cancel(&u->s3);
+    u->session = SYKO_UDS_SESSION_DEFAULT;
+    u->p2 = SYKO_UDS_P2_US;
+    u->p2x = SYKO_UDS_P2X_US;
+}
+
+/* The owner of opaque is going away, its requests finish without telling it */
+void sykoUdsDetach(const void *opaque){
+    for (int i = 0; i < syko_ecus_count; i++)
+        if (uds_ecus[i].done && uds_ecus[i].opaque == opaque)
+            uds_ecus[i].done = NULL;
+}
+
+int sykoUdsInit(struct lws_context *cx){
+    uds_cx = cx;
+    memset(uds_ecus, 0, sizeof(uds_ecus));
+
+    for (int i = 0; i < syko_ecus_count; i++) {
+        uds_ecus[i].session = SYKO_UDS_SESSION_DEFAULT;
+        uds_ecus[i].p2 = SYKO_UDS_P2_US;
+        uds_ecus[i].p2x = SYKO_UDS_P2X_US;
+    }
+
+    return 0;
+}
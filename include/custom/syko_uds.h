@@ -0,0 +1,64 @@
+#ifndef SYKO_UDS_H
+#define SYKO_UDS_H
+
+#include <libwebsockets.h>
+#include "syko_isotp.h"
+
+/*
+ * UDS (ISO 14229) client over ISO-TP. Each ECU has one request in flight
+ * at a time, and any number of ECUs can have one at once, so a scan of
+ * the whole vehicle takes as long as its slowest ECU. Everything runs on
+ * the lws service thread; the P2 and P2* response timers are lws_sul.
+ * P2 only bounds the start of the response: once the first frame of a
+ * segmented one arrives, ISO-TP's N_Cr supervises the rest of it.
+ *
+ * A negative response with responsePending (0x78) re-arms the timer with
+ * P2* and keeps waiting, up to SYKO_UDS_PENDING_MAX times.
+ *
+ * Each ECU keeps its session state. A positive DiagnosticSessionControl
+ * records the session and the P2 / P2* the ECU announced. While a
+ * non-default session is active, an idle ECU gets a suppressed
+ * TesterPresent every SYKO_UDS_S3_US so it doesn't fall back to default.
+ * A positive ECUReset puts it back into the default session, and
+ * sykoUdsRelease() gives a session up without asking the ECU.
+ *
+ * done() is called once for each sykoUdsRequest() that returned 0, unless
+ * sykoUdsDetach() was called for its opaque first. err is 0 with the
+ * positive response, the NRC of a negative response, or a negative errno.
+ * The response is only valid during the call.
+ */
+#define SYKO_UDS_P2_US          (50 * LWS_US_PER_MS)    // Until the ECU announces its own
+#define SYKO_UDS_P2X_US         (5000 * LWS_US_PER_MS)
+#define SYKO_UDS_MARGIN_US      (50 * LWS_US_PER_MS)    // Queueing and bus slack on top of P2
+#define SYKO_UDS_S3_US          (2000 * LWS_US_PER_MS)
+#define SYKO_UDS_PENDING_MAX    20
+
+// Services, sub-functions and NRCs we use
+#define SYKO_UDS_SESSION_CONTROL    0x10
+#define SYKO_UDS_ECU_RESET          0x11
+#define SYKO_UDS_CLEAR_DTC          0x14
+#define SYKO_UDS_READ_DTC           0x19
+#define SYKO_UDS_TESTER_PRESENT     0x3E
+#define SYKO_UDS_NEGATIVE           0x7F
+
+#define SYKO_UDS_SESSION_DEFAULT    0x01
+#define SYKO_UDS_SESSION_EXTENDED   0x03
+#define SYKO_UDS_RESET_HARD         0x01
+#define SYKO_UDS_DTC_BY_STATUS      0x02
+#define SYKO_UDS_SUPPRESS_POS       0x80
+
+#define SYKO_UDS_NRC_PENDING        0x78
+
+typedef void (*syko_uds_cb)(enum syko_ecus ecu, int err, const uint8_t *rsp, size_t len,
+                            void *opaque);
+
+int sykoUdsInit(struct lws_context *cx);
+int sykoUdsRequest(enum syko_ecus ecu, const uint8_t *req, size_t len,
+                   syko_uds_cb done, void *opaque);
+int sykoUdsRequestRef(enum syko_ecus ecu, const uint8_t *hdr, size_t hlen,
+                      const uint8_t *data, size_t len, syko_uds_cb done, void *opaque);
+uint8_t sykoUdsSession(enum syko_ecus ecu);
+void sykoUdsRelease(enum syko_ecus ecu);
+void sykoUdsDetach(const void *opaque);
+
+#endif
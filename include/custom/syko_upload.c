@@ -0,0 +1,443 @@
+#include "syko_upload.h"
+#include "syko_fwcache.h"
+#include "syko_handler.h"
+#include "syko_worker.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+enum syko_upload_state {
+    UPLOAD_OPENING,                 // Worker: creating and preallocating the .part file
+    UPLOAD_RECEIVING,
+    UPLOAD_SYNCING,                 // Worker: writing the .part file back to disk
+    UPLOAD_DONE,                    // remotegui/upload-done not sent yet
+};
+
+struct syko_upload {
+    lws_dll2_t list;                // upload_list
+    lws_sorted_usec_list_t sul;     // Expiry while no stream owns it
+    struct syko_work work;          // fd and map belong to it while it runs
+    struct syko_session *session;
+    int sequence;
+    char name[SYKO_UPLOAD_NAME_MAX];
+    int fd;
+    uint8_t *map;
+    size_t size, received;
+    struct lws_genhash_ctx hash;
+    uint8_t digest[32];
+    char hex[SYKO_FWCACHE_HEX + 1]; // digest
+    uint8_t expect[32];
+    uint8_t has_expect;
+    uint8_t state;
+    uint8_t dropped;                // Freed while a worker had it
+    uint8_t pending;                // The upload-image reply waits for the file
+    int err;                        // From the worker
+    const char *status;
+};
+
+static struct lws_context *upload_cx;
+static lws_dll2_owner_t upload_list;
+
+static void sykoUploadHex(const uint8_t *digest, char *hex){
+    for (int i = 0; i < 32; i++) {
+        *hex++ = "0123456789abcdef"[digest[i] >> 4];
+        *hex++ = "0123456789abcdef"[digest[i] & 0xF];
+    }
+    *hex = '\0';
+}
+
+static void sykoUploadPath(char *path, size_t len, const char *name){
+    lws_snprintf(path, len, "%s/%s.part", SYKO_FLASH_DIR, name);
+}
+
+/*
+ * Releases everything but the .part file, which a new upload overwrites.
+ * While a worker has the file that waits until the work comes back.
+ */
+static void sykoUploadFree(struct syko_upload *u){
+    uint8_t digest[32];
+
+    lws_sul_cancel(&u->sul);
+    lws_dll2_remove(&u->list);
+    u->session = NULL;
+
+    if (u->state == UPLOAD_OPENING || u->state == UPLOAD_SYNCING) {
+        u->dropped = 1;
+        return;
+    }
+
+    if (u->map)
+        munmap(u->map, u->size);
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->state == UPLOAD_RECEIVING)
+        lws_genhash_destroy(&u->hash, digest);
+
+    free(u);
+}
+
+static void sykoUploadExpire(lws_sorted_usec_list_t *sul){
+    struct syko_upload *u = lws_container_of(sul, struct syko_upload, sul);
+
+    lwsl_user("Upload %s abandoned at %zu of %zu bytes\n", u->name, u->received, u->size);
+    sykoUploadFree(u);
+}
+
+static struct syko_upload * sykoUploadFind(const char *name){
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&upload_list)) {
+        struct syko_upload *u = lws_container_of(d, struct syko_upload, list);
+
+        if (!strcmp(u->name, name))
+            return u;
+    } lws_end_foreach_dll(d);
+
+    return NULL;
+}
+
+/* Worker: open and preallocate the .part file and map it */
+static void sykoUploadOpen(struct syko_work *w){
+    struct syko_upload *u = lws_container_of(w, struct syko_upload, work);
+    char path[256];
+
+    sykoUploadPath(path, sizeof(path), u->name);
+    u->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (u->fd < 0)
+        goto bail;
+
+    // Claim the space up front, a full disk fails here rather than mid upload
+    u->err = posix_fallocate(u->fd, 0, (off_t)u->size);
+    if (u->err)
+        goto bail;
+
+    u->map = mmap(NULL, u->size, PROT_WRITE, MAP_SHARED, u->fd, 0);
+    if (u->map == MAP_FAILED) {
+        u->map = NULL;
+        goto bail;
+    }
+
+    return;
+
+bail:
+    if (!u->err)
+        u->err = errno;
+    if (u->fd >= 0) {
+        close(u->fd);
+        u->fd = -1;
+        unlink(path);
+    }
+}
+
+/* Back on the lws thread: the offset can go to the client */
+static void sykoUploadOpened(struct syko_work *w){
+    static const char payload[] = "{\"offset\":0}";
+    struct syko_upload *u = lws_container_of(w, struct syko_upload, work);
+    struct syko_session *session = u->pending ? u->session : NULL;
+
+    u->state = UPLOAD_RECEIVING;
+    if (w->cancelled && !u->err)
+        u->err = ECANCELED;
+
+    if (u->dropped) {
+        u->dropped = 0;
+        sykoUploadFree(u);
+        return;
+    }
+
+    if (u->err) {
+        lwsl_err("%s: %s: %d\n", __func__, u->name, u->err);
+        if (u->session)
+            u->session->upload = NULL;
+        if (session && session->complete)
+            session->complete(session, u->sequence, "no-space", NULL, 0);
+        sykoUploadFree(u);
+        return;
+    }
+
+    // The stream went while we were opening, keep it for a resume
+    if (!u->session) {
+        lws_sul_schedule(upload_cx, 0, &u->sul, sykoUploadExpire, SYKO_UPLOAD_KEEP_US);
+        return;
+    }
+
+    if (session && session->complete)
+        session->complete(session, u->sequence, "ok", payload, sizeof(payload) - 1);
+}
+
+/* The file work goes to a worker, or is done here if there is none */
+static void sykoUploadSubmit(struct syko_upload *u, void (*run)(struct syko_work *),
+                             void (*done)(struct syko_work *)){
+    u->work.run = run;
+    u->work.done = done;
+    u->work.owner = u;
+
+    if (sykoWorkerSubmit(&u->work)) {
+        run(&u->work);
+        done(&u->work);
+    }
+}
+
+/* A new upload, in UPLOAD_OPENING until its file is ready */
+static struct syko_upload * sykoUploadCreate(const char *name, size_t size){
+    struct syko_upload *u = calloc(1, sizeof(*u));
+
+    if (!u)
+        return NULL;
+
+    lws_strncpy(u->name, name, sizeof(u->name));
+    u->size = size;
+    u->fd = -1;
+
+    if (lws_genhash_init(&u->hash, LWS_GENHASH_TYPE_SHA256)) {
+        free(u);
+        return NULL;
+    }
+
+    lws_dll2_add_tail(&u->list, &upload_list);
+
+    return u;
+}
+
+/*
+ * Starts or resumes an upload for the session. *offset is where the
+ * client has to continue from; it is 0 unless an upload of the same image
+ * and size was dropped earlier. If sha256 is given and already cached
+ * with that size, the name is just linked to it and *offset is size.
+ * A new upload returns SYKO_REPLY_PENDING while a worker creates its
+ * file; the offset then comes through session->complete().
+ */
+int sykoUploadStart(struct syko_session *session, int sequence, const char *image,
+                    size_t size, const char *sha256, size_t *offset){
+    struct syko_upload *u;
+    char hex[SYKO_FWCACHE_HEX + 1];
+    uint8_t expect[32];
+
+    if (!sykoFwCacheNameValid(image))
+        return -EINVAL;
+
+    if (!size || size > SYKO_UPLOAD_SIZE_MAX || (sha256 && (strlen(sha256) != 64 || lws_hex_to_byte_array(sha256, expect, 32) != 32)))
+        return -EINVAL;
+
+    if (session->upload)
+        return -EBUSY;
+
+    u = sykoUploadFind(image);
+    if (u && (u->session || u->state != UPLOAD_RECEIVING))
+        return -EBUSY;
+
+    if (sha256 && sykoFwCacheHas(sha256, size)) {
+        sykoUploadHex(expect, hex);
+        if (sykoFwCacheLink(hex, image))
+            return -ENOSPC;
+
+        lwsl_user("Upload %s: %s already cached\n", image, hex);
+        *offset = size;
+        return 0;
+    }
+
+    // A different size is a different image, start over
+    if (u && u->size != size) {
+        sykoUploadFree(u);
+        u = NULL;
+    }
+
+    if (!u) {
+        if (upload_list.count >= SYKO_UPLOAD_MAX)
+            return -EBUSY;
+        u = sykoUploadCreate(image, size);
+        if (!u)
+            return -ENOSPC;
+    }
+
+    lws_sul_cancel(&u->sul);
+    u->session = session;
+    u->sequence = sequence;
+    u->has_expect = !!sha256;
+    if (sha256)
+        memcpy(u->expect, expect, sizeof(expect));
+
+    session->upload = u;
+    *offset = u->received;
+
+    lwsl_user("Upload %s: %zu bytes from %zu\n", u->name, u->size, u->received);
+
+    if (u->state != UPLOAD_OPENING)
+        return 0;
+
+    // Without a worker this has finished, or failed and freed u, on return
+    sykoUploadSubmit(u, sykoUploadOpen, sykoUploadOpened);
+    if (session->upload != u)
+        return -ENOSPC;
+    if (u->state != UPLOAD_OPENING)
+        return 0;
+
+    u->pending = 1;
+
+    return SYKO_REPLY_PENDING;
+}
+
+/* Worker: the image has to be on disk before the cache takes it under its hash */
+static void sykoUploadSync(struct syko_work *w){
+    struct syko_upload *u = lws_container_of(w, struct syko_upload, work);
+
+    if (fdatasync(u->fd))
+        u->err = errno;
+
+    munmap(u->map, u->size);
+    u->map = NULL;
+    close(u->fd);
+    u->fd = -1;
+}
+
+/* Back on the lws thread: file it in the cache and tell the stream */
+static void sykoUploadSynced(struct syko_work *w){
+    struct syko_upload *u = lws_container_of(w, struct syko_upload, work);
+    char part[256];
+
+    // Torn down before a worker got to it
+    if (w->cancelled)
+        sykoUploadSync(w);
+
+    u->state = UPLOAD_DONE;
+    sykoUploadPath(part, sizeof(part), u->name);
+
+    if (u->err) {
+        u->status = "error";
+        unlink(part);
+    } else if (u->has_expect && memcmp(u->digest, u->expect, sizeof(u->digest))) {
+        u->status = "bad-hash";
+        unlink(part);
+    } else if (sykoFwCacheAdd(u->hex, part) || sykoFwCacheLink(u->hex, u->name)) {
+        u->status = "error";
+        unlink(part);
+    } else
+        u->status = "ok";
+
+    lwsl_user("Upload %s: %s\n", u->name, u->status);
+
+    // Nobody left to tell, the image is cached all the same
+    if (u->dropped || !u->session) {
+        u->dropped = 0;
+        sykoUploadFree(u);
+        return;
+    }
+
+    if (u->session->wake)
+        u->session->wake(u->session);
+}
+
+/* Every byte is in: the stream goes back to requests while the file is synced */
+static void sykoUploadFinish(struct syko_upload *u){
+    lws_genhash_destroy(&u->hash, u->digest);
+    sykoUploadHex(u->digest, u->hex);
+
+    u->state = UPLOAD_SYNCING;
+    u->session->upload = NULL;
+
+    sykoUploadSubmit(u, sykoUploadSync, sykoUploadSynced);
+}
+
+/* Image bytes from the stream; more than the announced size fails the upload */
+int sykoUploadRx(struct syko_session *session, const uint8_t *buf, size_t len){
+    struct syko_upload *u = session->upload;
+
+    if (u->state != UPLOAD_RECEIVING) {
+        lwsl_warn("%s: %s data before its offset was sent\n", __func__, u->name);
+        goto bail;
+    }
+
+    if (len > u->size - u->received) {
+        lwsl_warn("%s: %s overran its size\n", __func__, u->name);
+        goto bail;
+    }
+
+    memcpy(u->map + u->received, buf, len);
+    if (lws_genhash_update(&u->hash, buf, len)) {
+        lwsl_warn("%s: %s hash update failed\n", __func__, u->name);
+        goto bail;
+    }
+    u->received += len;
+
+    if (u->received == u->size)
+        sykoUploadFinish(u);
+
+    return 0;
+
+bail:
+    session->upload = NULL;
+    u->session = NULL;
+    sykoUploadFree(u);
+
+    return -1;
+}
+
+int sykoUploadPending(struct syko_session *session){
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&upload_list)) {
+        struct syko_upload *u = lws_container_of(d, struct syko_upload, list);
+
+        if (u->state == UPLOAD_DONE && u->session == session)
+            return 1;
+    } lws_end_foreach_dll(d);
+
+    return 0;
+}
+
+/* remotegui/upload-done for a finished upload, which is then forgotten */
+size_t sykoUploadWrite(struct syko_session *session, uint8_t *buf, size_t len){
+    struct syko_upload *u = NULL;
+    int n;
+
+    if (len < SYKO_UPLOAD_MSG_MIN)
+        return 0;
+
+    lws_start_foreach_dll(struct lws_dll2 *, d, lws_dll2_get_head(&upload_list)) {
+        struct syko_upload *c = lws_container_of(d, struct syko_upload, list);
+
+        if (!u && c->state == UPLOAD_DONE && c->session == session)
+            u = c;
+    } lws_end_foreach_dll(d);
+
+    if (!u)
+        return 0;
+
+    n = lws_snprintf((char *)buf, len,
+                      "{\"remotegui/upload-done\":{\"image\":\"%s\",\"bytes\":%zu,\"sha256\":\"%s"
+                      "\"},\"version\":\"" SYKO_PROTOCOL_VERSION "\",\"sequence\":%d,"
+                      "\"response\":\"remotegui/upload-done\",\"status\":\"%s\"}",
+                      u->name, u->received, u->hex, u->sequence, u->status);
+
+    sykoUploadFree(u);
+
+    return (size_t)n;
+}
+
+/* The stream is closing, its unfinished upload waits a while to be resumed */
+void sykoUploadClose(struct syko_session *session){
+    lws_start_foreach_dll_safe(struct lws_dll2 *, d, d1, lws_dll2_get_head(&upload_list)) {
+        struct syko_upload *u = lws_container_of(d, struct syko_upload, list);
+
+        // Opening and syncing uploads are seen to when their work comes back
+        if (u->session == session) {
+            u->session = NULL;
+            if (u->state == UPLOAD_DONE)
+                sykoUploadFree(u);
+            else if (u->state == UPLOAD_RECEIVING)
+                lws_sul_schedule(upload_cx, 0, &u->sul, sykoUploadExpire, SYKO_UPLOAD_KEEP_US);
+        }
+    } lws_end_foreach_dll_safe(d, d1);
+
+    session->upload = NULL;
+}
+
+int sykoUploadInit(struct lws_context *cx){
+    upload_cx = cx;
+
+    return 0;
+}
+
+void sykoUploadDestroy(){
+    lws_start_foreach_dll_safe(struct lws_dll2 *, d, d1, lws_dll2_get_head(&upload_list)) {
+        sykoUploadFree(lws_container_of(d, struct syko_upload, list));
+    } lws_end_foreach_dll_safe(d, d1);
+}
@@ -0,0 +1,48 @@
+#ifndef SYKO_UPLOAD_H
+#define SYKO_UPLOAD_H
+
+#include <libwebsockets.h>
+#include "syko_fwcache.h"
+
+struct syko_session;
+
+/*
+ * Firmware image upload over the request stream. remotegui/upload-image
+ * names the image and its size and is answered with the offset to send
+ * from. From then on every byte the stream receives, in
+ * messages of any size and fragmentation, is image data until size bytes
+ * have arrived; then the stream goes back to requests and a
+ * remotegui/upload-done message reports the outcome and the SHA-256.
+ *
+ * The image is written through a shared mapping of a preallocated
+ * <image>.part file in SYKO_FLASH_DIR and hashed with lws_genhash as it
+ * arrives, so finishing is just a rename into the firmware cache with no
+ * second pass. Creating and preallocating the file, and syncing it to
+ * disk before the rename, run on a syko_worker thread: a new upload's
+ * reply and remotegui/upload-done go out when that work is back. A
+ * "sha256" given with the request is checked against it, and if that
+ * image is cached already nothing needs uploading at all.
+ * gzip images are stored and hashed as sent and inflated when flashed.
+ *
+ * If the stream drops, the upload is kept for SYKO_UPLOAD_KEEP_US with
+ * its hash state; asking for the same image and size again resumes it
+ * from the offset already received.
+ */
+#define SYKO_UPLOAD_MAX         4
+#define SYKO_UPLOAD_SIZE_MAX    (64 * 1024 * 1024)
+#define SYKO_UPLOAD_KEEP_US     (10 * 60 * LWS_US_PER_SEC)
+#define SYKO_UPLOAD_NAME_MAX    SYKO_FWCACHE_NAME_MAX
+#define SYKO_UPLOAD_MSG_MIN     256     // Smallest tx window we render into
+
+struct syko_upload;
+
+int sykoUploadInit(struct lws_context *cx);
+void sykoUploadDestroy();
+int sykoUploadStart(struct syko_session *session, int sequence, const char *image,
+                    size_t size, const char *sha256, size_t *offset);
+int sykoUploadRx(struct syko_session *session, const uint8_t *buf, size_t len);
+size_t sykoUploadWrite(struct syko_session *session, uint8_t *buf, size_t len);
+int sykoUploadPending(struct syko_session *session);
+void sykoUploadClose(struct syko_session *session);
+
+#endif
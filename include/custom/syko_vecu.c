@@ -0,0 +1,468 @@
+#include <pthread.h>
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "syko_vecu.h"
+
+#define VECU_POLL_MS        100     // How often the thread looks at the stop flag
+#define VECU_FC_TIMEOUT_MS  1000    // N_Bs while we send
+
+// UDS service ids, positive responses are sid | 0x40
+#define UDS_SESSION         0x10
+#define UDS_RESET           0x11
+#define UDS_CLEAR_DTC       0x14
+#define UDS_READ_DTC        0x19
+#define UDS_READ_DID        0x22
+#define UDS_SECURITY        0x27
+#define UDS_ROUTINE         0x31
+#define UDS_DOWNLOAD        0x34
+#define UDS_TRANSFER        0x36
+#define UDS_TRANSFER_EXIT   0x37
+#define UDS_TESTER_PRESENT  0x3E
+#define UDS_NEGATIVE        0x7F
+
+#define UDS_NRC_NOT_SUPPORTED   0x11
+#define UDS_NRC_SEQUENCE        0x24
+#define UDS_NRC_WRONG_BLOCK     0x73
+
+struct syko_vecu_ecu {
+    const struct syko_ecu *ecu;
+    uint8_t buf[SYKO_ISOTP_MAX];    // Request being reassembled
+    size_t len, off;
+    uint8_t dl;
+    uint8_t sn;
+    uint8_t block_left;
+    uint8_t receiving;
+    uint8_t fd;                     // Answer in FD, the tester spoke FD
+    uint8_t dtc_cleared;
+    uint8_t downloading;
+    uint8_t next_block;
+};
+
+static struct syko_vecu_cfg vecu_cfg;
+static struct syko_vecu_ecu vecu_ecus[syko_ecus_count];
+static int vecu_ecu_count;
+static int vecu_sock = -1;
+static int vecu_fd_frames;
+static unsigned int vecu_seed;
+static pthread_t vecu_thread;
+static int vecu_running, vecu_stop;
+
+static void sykoVecuSleepUs(unsigned long us){
+    struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+static int sykoVecuRecv(struct canfd_frame *frame, int *fd, int timeout_ms){
+    struct pollfd pfd = { vecu_sock, POLLIN, 0 };
+    ssize_t n;
+
+    for (;;) {
+        n = poll(&pfd, 1, timeout_ms);
+        if (n <= 0)
+            return n < 0 && errno != EINTR ? -1 : 0;
+
+        n = read(vecu_sock, frame, sizeof(*frame));
+        if (n != CAN_MTU && n != CANFD_MTU)
+            continue;
+
+        // Simulated bus loss
+        if (vecu_cfg.loss_pct && (unsigned int)rand_r(&vecu_seed) % 100 < vecu_cfg.loss_pct)
+            continue;
+
+        *fd = n == CANFD_MTU;
+        return 1;
+    }
+}
+
+static int sykoVecuFrame(struct syko_vecu_ecu *e, const uint8_t *pci, size_t pci_len,
+                         const uint8_t *data, size_t len){
+    static const uint8_t fd_lens[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+    struct canfd_frame frame;
+    size_t i;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = e->ecu->rx_id;
+    frame.len = CAN_MAX_DLEN;
+    if (e->fd) {
+        for (i = 0; i < LWS_ARRAY_SIZE(fd_lens) - 1 && fd_lens[i] < pci_len + len; i++)
+            ;
+        frame.len = fd_lens[i];
+    }
+    memset(frame.data, SYKO_ISOTP_PAD, frame.len);
+    memcpy(frame.data, pci, pci_len);
+    if (len)
+        memcpy(frame.data + pci_len, data, len);
+
+    return write(vecu_sock, &frame, e->fd ? CANFD_MTU : CAN_MTU) < 0 ? -1 : 0;
+}
+
+static void sykoVecuFlowControl(struct syko_vecu_ecu *e){
+    uint8_t pci[3] = { 0x30, SYKO_VECU_BS, SYKO_VECU_STMIN };
+
+    sykoVecuFrame(e, pci, sizeof(pci), NULL, 0);
+}
+
+/* STmin byte to microseconds, as the tester asked for it */
+static unsigned long sykoVecuStmin(uint8_t stmin){
+    if (stmin <= 0x7F)
+        return stmin * 1000ul;
+    if (stmin >= 0xF1 && stmin <= 0xF9)
+        return (stmin - 0xF0) * 100ul;
+
+    return 127000ul;
+}
+
+/* Blocking ISO-TP send, waits for the tester's flow control between blocks */
+static void sykoVecuSend(struct syko_vecu_ecu *e, const uint8_t *data, size_t len){
+    size_t dl = e->fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN, off, n;
+    struct canfd_frame fc;
+    uint8_t pci[2], bs = 0, sn = 1;
+    unsigned long stmin = 0;
+    int fd, blk = 0;
+
+    if (len <= CAN_MAX_DLEN - 1 || len <= dl - 2) {
+        pci[0] = (uint8_t)(len <= CAN_MAX_DLEN - 1 ? len : 0);
+        pci[1] = (uint8_t)len;
+        sykoVecuFrame(e, pci, len <= CAN_MAX_DLEN - 1 ? 1 : 2, data, len);
+        return;
+    }
+
+    pci[0] = (uint8_t)(0x10 | (len >> 8));
+    pci[1] = (uint8_t)len;
+    sykoVecuFrame(e, pci, 2, data, dl - 2);
+    off = dl - 2;
+
+    while (off < len) {
+        if (!blk) {
+            // Wait for CTS, anything else on the bus is ignored meanwhile
+            for (;;) {
+                if (sykoVecuRecv(&fc, &fd, VECU_FC_TIMEOUT_MS) <= 0)
+                    return;
+                if (fc.can_id == e->ecu->tx_id && (fc.data[0] & 0xF0) == 0x30) {
+                    if ((fc.data[0] & 0x0F) == 0)
+                        break;
+                    if ((fc.data[0] & 0x0F) != 1)
+                        return;
+                }
+            }
+            bs = fc.data[1];
+            stmin = sykoVecuStmin(fc.data[2]);
+            blk = bs ? bs : -1;
+        }
+
+        n = len - off > dl - 1 ? dl - 1 : len - off;
+        pci[0] = (uint8_t)(0x20 | sn);
+        if (sykoVecuFrame(e, pci, 1, data + off, n))
+            return;
+        sn = (sn + 1) & 0x0F;
+        off += n;
+
+        if (blk > 0)
+            blk--;
+        if (stmin && off < len)
+            sykoVecuSleepUs(stmin);
+    }
+}
+
+/* Canned UDS behaviour, returns the response length, 0 for no response */
+static size_t sykoVecuUds(struct syko_vecu_ecu *e, const uint8_t *req, size_t len, uint8_t *rsp){
+    static const uint8_t dtcs[] = {
+        0x01, 0x23, 0x45, 0x09,     // P0123-45, testFailed | confirmed
+        0xC1, 0x00, 0x01, 0x08,     // U0100-01, confirmed
+    };
+    uint8_t sid = req[0], sub = len > 1 ? req[1] : 0;
+    size_t n = 0;
+
+    rsp[n++] = (uint8_t)(sid | 0x40);
+
+    switch (sid) {
+    case UDS_SESSION:
+        rsp[n++] = sub;
+        rsp[n++] = 0x00;    // P2 50 ms
+        rsp[n++] = 0x32;
+        rsp[n++] = 0x01;    // P2* 5 s
+        rsp[n++] = 0xF4;
+        break;
+
+    case UDS_RESET:
+        rsp[n++] = sub;
+        e->downloading = 0;
+        break;
+
+    case UDS_TESTER_PRESENT:
+        if (sub & 0x80)
+            return 0;
+        rsp[n++] = sub;
+        break;
+
+    case UDS_SECURITY:
+        rsp[n++] = sub;
+        if (sub & 1) {
+            rsp[n++] = 0x12;
+            rsp[n++] = 0x34;
+            rsp[n++] = 0x56;
+            rsp[n++] = 0x78;
+        }
+        break;
+
+    case UDS_READ_DTC:
+        rsp[n++] = sub;
+        if (sub == 0x02) {
+            rsp[n++] = 0xFF;    // Status availability mask
+            if (!e->dtc_cleared) {
+                memcpy(rsp + n, dtcs, sizeof(dtcs));
+                n += sizeof(dtcs);
+            }
+        }
+        break;
+
+    case UDS_CLEAR_DTC:
+        e->dtc_cleared = 1;
+        break;
+
+    case UDS_READ_DID:
+        if (len < 3)
+            goto negative;
+        rsp[n++] = req[1];
+        rsp[n++] = req[2];
+        if (((req[1] << 8) | req[2]) == SYKO_VECU_DID_BULK) {
+            memset(rsp + n, 0x55, SYKO_ISOTP_MAX - n);
+            n = SYKO_ISOTP_MAX;
+            break;
+        }
+        n += (size_t)lws_snprintf((char *)rsp + n, 32, "VECU-%s", e->ecu->name);
+        break;
+
+    case UDS_ROUTINE:
+        if (len < 4)
+            goto negative;
+        memcpy(rsp + n, req + 1, 3);
+        n += 3;
+        rsp[n++] = 0x00;
+        break;
+
+    case UDS_DOWNLOAD:
+        e->downloading = 1;
+        e->next_block = 1;
+        rsp[n++] = 0x20;    // Two byte maxNumberOfBlockLength
+        rsp[n++] = (uint8_t)(SYKO_ISOTP_MAX >> 8);
+        rsp[n++] = (uint8_t)SYKO_ISOTP_MAX;
+        break;
+
+    case UDS_TRANSFER:
+        if (!e->downloading || len < 2) {
+            sub = UDS_NRC_SEQUENCE;
+            goto nrc;
+        }
+        // A repeat of the last block is allowed, it was our answer that got lost
+        if (sub == e->next_block)
+            e->next_block++;
+        else if (sub != (uint8_t)(e->next_block - 1)) {
+            sub = UDS_NRC_WRONG_BLOCK;
+            goto nrc;
+        }
+        rsp[n++] = sub;
+        break;
+
+    case UDS_TRANSFER_EXIT:
+        if (!e->downloading) {
+            sub = UDS_NRC_SEQUENCE;
+            goto nrc;
+        }
+        e->downloading = 0;
+        break;
+
+    default:
+negative:
+        sub = UDS_NRC_NOT_SUPPORTED;
+nrc:
+        rsp[0] = UDS_NEGATIVE;
+        rsp[1] = sid;
+        rsp[2] = sub;
+        return 3;
+    }
+
+    return n;
+}
+
+static void sykoVecuRequest(struct syko_vecu_ecu *e, const uint8_t *req, size_t len){
+    uint8_t rsp[SYKO_ISOTP_MAX];
+    size_t n = sykoVecuUds(e, req, len, rsp);
+
+    if (!n)
+        return;
+
+    if (vecu_cfg.latency_ms)
+        sykoVecuSleepUs(vecu_cfg.latency_ms * 1000ul);
+
+    sykoVecuSend(e, rsp, n);
+}
+
+static void sykoVecuFrameIn(struct syko_vecu_ecu *e, const struct canfd_frame *frame){
+    const uint8_t *d = frame->data;
+    size_t len, off, n;
+
+    switch (d[0] & 0xF0) {
+    case 0x00:
+        off = 1;
+        len = d[0] & 0x0F;
+        if (!len && frame->len > CAN_MAX_DLEN) {
+            off = 2;
+            len = d[1];
+        }
+        if (len && len <= (size_t)frame->len - off) {
+            e->receiving = 0;
+            sykoVecuRequest(e, d + off, len);
+        }
+        break;
+
+    case 0x10:
+        len = ((size_t)(d[0] & 0x0F) << 8) | d[1];
+        if (frame->len < CAN_MAX_DLEN || len <= (size_t)frame->len - 2 || len > SYKO_ISOTP_MAX)
+            break;
+        n = (size_t)frame->len - 2;
+        memcpy(e->buf, d + 2, n);
+        e->len = len;
+        e->off = n;
+        e->dl = frame->len;
+        e->sn = 1;
+        e->block_left = SYKO_VECU_BS;
+        e->receiving = 1;
+        sykoVecuFlowControl(e);
+        break;
+
+    case 0x20:
+        if (!e->receiving || (d[0] & 0x0F) != e->sn) {
+            e->receiving = 0;
+            break;
+        }
+        n = e->len - e->off;
+        if (n > (size_t)e->dl - 1)
+            n = (size_t)e->dl - 1;
+        if (n > (size_t)frame->len - 1) {
+            e->receiving = 0;
+            break;
+        }
+        memcpy(e->buf + e->off, d + 1, n);
+        e->off += n;
+        e->sn = (e->sn + 1) & 0x0F;
+
+        if (e->off == e->len) {
+            e->receiving = 0;
+            sykoVecuRequest(e, e->buf, e->len);
+        } else if (SYKO_VECU_BS && !--e->block_left) {
+            e->block_left = SYKO_VECU_BS;
+            sykoVecuFlowControl(e);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void * sykoVecuThread(void *arg){
+    struct canfd_frame frame;
+    int fd, n;
+
+    while (!__atomic_load_n(&vecu_stop, __ATOMIC_RELAXED)) {
+        n = sykoVecuRecv(&frame, &fd, VECU_POLL_MS);
+        if (n < 0)
+            break;
+        if (!n || !frame.len)
+            continue;
+
+        for (int i = 0; i < vecu_ecu_count; i++)
+            if (vecu_ecus[i].ecu->tx_id == (frame.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK))) {
+                vecu_ecus[i].fd = (uint8_t)(fd && vecu_fd_frames);
+                sykoVecuFrameIn(&vecu_ecus[i], &frame);
+                break;
+            }
+    }
+
+    return NULL;
+}
+
+int sykoVecuStart(const struct syko_vecu_cfg *cfg){
+    struct can_filter filters[syko_ecus_count];
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    int on = 1;
+
+    vecu_cfg = *cfg;
+    vecu_seed = (unsigned int)time(NULL);
+    vecu_ecu_count = 0;
+
+    for (int i = 0; i < syko_ecus_count; i++) {
+        const struct syko_ecu *ecu = sykoIsotpEcu((enum syko_ecus)i);
+
+        if (strcmp(sykoCanName(ecu->bus), cfg->ifname))
+            continue;
+
+        memset(&vecu_ecus[vecu_ecu_count], 0, sizeof(vecu_ecus[0]));
+        vecu_ecus[vecu_ecu_count].ecu = ecu;
+        filters[vecu_ecu_count].can_id = ecu->tx_id;
+        filters[vecu_ecu_count].can_mask = SYKO_CAN_MASK_EXACT(ecu->tx_id);
+        vecu_ecu_count++;
+    }
+
+    if (!vecu_ecu_count) {
+        lwsl_err("%s: no ECU sits on %s\n", __func__, cfg->ifname);
+        return 1;
+    }
+
+    vecu_sock = socket(PF_CAN, SOCK_RAW | SOCK_CLOEXEC, CAN_RAW);
+    if (vecu_sock < 0)
+        return 1;
+
+    memset(&ifr, 0, sizeof(ifr));
+    lws_strncpy(ifr.ifr_name, cfg->ifname, sizeof(ifr.ifr_name));
+    if (ioctl(vecu_sock, SIOCGIFINDEX, &ifr) < 0) {
+        lwsl_err("%s: no interface %s\n", __func__, cfg->ifname);
+        goto bail;
+    }
+
+    // Without CAN_RAW_FD_FRAMES the kernel doesn't pass us FD frames at all
+    vecu_fd_frames = !cfg->classic &&
+                     !setsockopt(vecu_sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on));
+    setsockopt(vecu_sock, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+               (socklen_t)(sizeof(filters[0]) * (size_t)vecu_ecu_count));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(vecu_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto bail;
+
+    vecu_stop = 0;
+    if (pthread_create(&vecu_thread, NULL, sykoVecuThread, NULL))
+        goto bail;
+    vecu_running = 1;
+
+    lwsl_user("Virtual ECU on %s: %d ECUs, latency %u ms, loss %u%%%s\n", cfg->ifname,
+              vecu_ecu_count, cfg->latency_ms, cfg->loss_pct, vecu_fd_frames ? "" : ", classic CAN");
+    return 0;
+
+bail:
+    close(vecu_sock);
+    vecu_sock = -1;
+    return 1;
+}
+
+void sykoVecuStop(){
+    if (!vecu_running)
+        return;
+
+    __atomic_store_n(&vecu_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(vecu_thread, NULL);
+    vecu_running = 0;
+
+    close(vecu_sock);
+    vecu_sock = -1;
+}
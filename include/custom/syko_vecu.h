@@ -0,0 +1,47 @@
+#ifndef SYKO_VECU_H
+#define SYKO_VECU_H
+
+#include "syko_isotp.h"
+
+/*
+ * Virtual ECU simulator for running the CAN path without hardware. It runs
+ * on its own thread with its own blocking CAN_RAW socket, normally on a
+ * vcan interface that the gateway's bus is also bound to, e.g.
+ *
+ *   ip link add dev can0 type vcan && ip link set can0 up
+ *   ./main --vecu can0 --vecu-latency 5 --vecu-loss 1
+ *
+ * It plays every ECU in SYKO_ECUS that sits on that interface: it answers
+ * ISO-TP (flow control, segmentation, classic or FD as it was spoken to)
+ * and gives canned positive responses to the UDS services our handlers
+ * use: sessions, tester present, security access, DTC read / clear,
+ * routines, reset and the RequestDownload / TransferData / TransferExit
+ * programming sequence. Anything else gets serviceNotSupported.
+ *
+ * ReadDataByIdentifier SYKO_VECU_DID_BULK is answered with a message of
+ * SYKO_ISOTP_MAX bytes, for measuring receive throughput.
+ *
+ * Latency is added before each response, loss drops received frames at
+ * random. It never touches lws, so it is safe off the service thread.
+ *
+ * With classic set it plays ECUs that only speak classic CAN, whatever
+ * SYKO_ECUS says: FD frames never reach it and it answers in classic CAN,
+ * as a real classic ECU on an FD capable bus would, e.g.
+ *
+ *   ./main --vecu can0 --vecu-classic --bench isotp
+ */
+#define SYKO_VECU_BS            8       // Block size in our flow control
+#define SYKO_VECU_STMIN         0
+#define SYKO_VECU_DID_BULK      0xF1FF
+
+struct syko_vecu_cfg {
+    const char *ifname;
+    unsigned int latency_ms;
+    unsigned int loss_pct;
+    int classic;                    // Classic CAN only, FD frames go unheard
+};
+
+int sykoVecuStart(const struct syko_vecu_cfg *cfg);
+void sykoVecuStop();
+
+#endif
@@ -0,0 +1,126 @@
+#include <pthread.h>
+#include "syko_worker.h"
+
+#define SYKO_WORKER_THREADS_MAX 4
+
+static struct lws_context *worker_cx;
+static pthread_t workers[SYKO_WORKER_THREADS_MAX];
+static int worker_count;
+
+// Submissions: workers sleep on the condvar, so a mutex costs nothing here
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submit_cond = PTHREAD_COND_INITIALIZER;
+static struct syko_work *submit_head, **submit_tail = &submit_head;
+static int worker_stop;
+
+// Completions: lock-free stack pushed by workers, drained by the lws thread
+static struct syko_work *done_head;
+
+static void * sykoWorkerThread(void *arg){
+    struct syko_work *w, *old;
+
+    for (;;) {
+        pthread_mutex_lock(&submit_lock);
+        while (!submit_head && !worker_stop)
+            pthread_cond_wait(&submit_cond, &submit_lock);
+
+        if (worker_stop) {
+            pthread_mutex_unlock(&submit_lock);
+            return NULL;
+        }
+
+        w = submit_head;
+        submit_head = w->next;
+        if (!submit_head)
+            submit_tail = &submit_head;
+        pthread_mutex_unlock(&submit_lock);
+
+        w->run(w);
+
+        old = __atomic_load_n(&done_head, __ATOMIC_RELAXED);
+        do {
+            w->next = old;
+        } while (!__atomic_compare_exchange_n(&done_head, &old, w, 1,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+        lws_cancel_service(worker_cx);
+    }
+}
+
+int sykoWorkerInit(struct lws_context *cx, int threads){
+    worker_cx = cx;
+    worker_stop = 0;
+
+    if (threads > SYKO_WORKER_THREADS_MAX)
+        threads = SYKO_WORKER_THREADS_MAX;
+
+    for (worker_count = 0; worker_count < threads; worker_count++)
+        if (pthread_create(&workers[worker_count], NULL, sykoWorkerThread, NULL)) {
+            lwsl_err("%s: thread create failed\n", __func__);
+            sykoWorkerDestroy();
+            return 1;
+        }
+
+    return 0;
+}
+
+int sykoWorkerSubmit(struct syko_work *w){
+    if (!worker_count)
+        return 1;
+
+    w->next = NULL;
+    w->cancelled = 0;
+
+    pthread_mutex_lock(&submit_lock);
+    *submit_tail = w;
+    submit_tail = &w->next;
+    pthread_cond_signal(&submit_cond);
+    pthread_mutex_unlock(&submit_lock);
+
+    return 0;
+}
+
+/* Call on the lws thread after LWS_CALLBACK_EVENT_WAIT_CANCELLED */
+void sykoWorkerService(){
+    struct syko_work *w, *next, *fifo = NULL;
+
+    w = __atomic_exchange_n(&done_head, NULL, __ATOMIC_ACQUIRE);
+
+    // The stack is newest first, reverse it to complete in order
+    while (w) {
+        next = w->next;
+        w->next = fifo;
+        fifo = w;
+        w = next;
+    }
+
+    while (fifo) {
+        next = fifo->next;
+        fifo->done(fifo);
+        fifo = next;
+    }
+}
+
+void sykoWorkerDestroy(){
+    struct syko_work *w, *next;
+    int n;
+
+    pthread_mutex_lock(&submit_lock);
+    worker_stop = 1;
+    pthread_cond_broadcast(&submit_cond);
+    pthread_mutex_unlock(&submit_lock);
+
+    for (n = 0; n < worker_count; n++)
+        pthread_join(workers[n], NULL);
+    worker_count = 0;
+
+    sykoWorkerService();
+
+    for (w = submit_head; w; w = next) {
+        next = w->next;
+        w->cancelled = 1;
+        w->done(w);
+    }
+    submit_head = NULL;
+    submit_tail = &submit_head;
+}
@@ -0,0 +1,26 @@
+#ifndef SYKO_WORKER_H
+#define SYKO_WORKER_H
+
+#include <libwebsockets.h>
+
+/*
+ * Worker threads for file work that would block the lws service thread.
+ * run() is called on a worker thread and must not touch lws or the cJSON
+ * arena. done() is called afterwards on the lws thread, woken through
+ * lws_cancel_service(); it is always called exactly once, with cancelled
+ * set if the pool was torn down first, and it owns freeing the work.
+ */
+struct syko_work {
+    struct syko_work *next;
+    void (*run)(struct syko_work *w);
+    void (*done)(struct syko_work *w);
+    void *owner;            // Cleared on the lws thread if the owner goes away
+    uint8_t cancelled;
+};
+
+int sykoWorkerInit(struct lws_context *cx, int threads);
+void sykoWorkerDestroy();
+int sykoWorkerSubmit(struct syko_work *w);
+void sykoWorkerService();
+
+#endif
@@ -1,6 +1,11 @@
 #include <libwebsockets.h>
 #include <signal.h>
 #include <syko_handler.h>
+#include <syko_arena.h>
+#include <syko_loop.h>
+#include <syko_vecu.h>
+#include <syko_bench.h>
+#include <syko_test.h>
 
 extern const lws_ss_info_t ssi_server_srv_t; // Check /include/custom/ss_server.h
 
@@ -28,12 +33,31 @@ static void sigint_handler(int sig)
 int main(int argc, const char **argv)
 {
 	struct lws_context_creation_info info;		
+	struct syko_vecu_cfg vecu;
+	const char *p;
+	int can;
 	
 	lws_context_info_defaults(&info, "policy.json");
 	lws_cmdline_option_handle_builtin(argc, argv, &info);	
 	signal(SIGINT, sigint_handler);
 
-	if(initCanBus()){
+	sykoArenaInit();
+
+	if(sykoCommandsInit()){
+		lwsl_user("Command table init fail.\n");
+		return 1;
+	}
+
+	if(sykoTemplateInit()){
+		lwsl_user("Response template init fail.\n");
+		return 1;
+	}
+
+	// The self tests, and benches run without --vecu, need no CAN interface
+	can = !lws_cmdline_option(argc, argv, "--test") &&
+	      (!lws_cmdline_option(argc, argv, "--bench") || lws_cmdline_option(argc, argv, "--vecu"));
+
+	if(can && sykoCanInit()){
 		lwsl_user("Socket init fail.\n");
 		return 1;
 	}
@@ -50,7 +74,42 @@ int main(int argc, const char **argv)
 		return 1;
 	}
 
+	if(sykoLoopInit(cx)){
+		lws_context_destroy(cx);
+		return 1;
+	}
+
+	// --test runs the self tests instead of serving, see syko_test.h
+	if (lws_cmdline_option(argc, argv, "--test")) {
+		test_result = sykoTestRun(cx);
+		lws_context_destroy(cx);
+		return lws_cmdline_passfail(argc, argv, test_result);
+	}
+
+	// --vecu <ifname> plays our ECUs on that (v)can interface, for running without hardware
+	if ((vecu.ifname = lws_cmdline_option(argc, argv, "--vecu"))) {
+		p = lws_cmdline_option(argc, argv, "--vecu-latency");
+		vecu.latency_ms = p ? (unsigned int)atoi(p) : 0;
+		p = lws_cmdline_option(argc, argv, "--vecu-loss");
+		vecu.loss_pct = p ? (unsigned int)atoi(p) : 0;
+		vecu.classic = !!lws_cmdline_option(argc, argv, "--vecu-classic");
+
+		if(sykoVecuStart(&vecu)){
+			lwsl_user("Virtual ECU init fail.\n");
+			lws_context_destroy(cx);
+			return 1;
+		}
+	}
+
+	// --bench <cmd|rsp|json|can|isotp|all> measures against the virtual ECU, then exits
+	if ((p = lws_cmdline_option(argc, argv, "--bench")) && sykoBenchStart(cx, vecu.ifname, p)) {
+		sykoVecuStop();
+		lws_context_destroy(cx);
+		return 1;
+	}
+
 	lws_context_default_loop_run_destroy(cx); 
+	sykoVecuStop();
 
 	return lws_cmdline_passfail(argc, argv, test_result);
 }